@@ -0,0 +1,268 @@
+/*
+ * Draw pages of text with glfont.c without a window, as on a
+ * headless build machine with Mesa's software rasteriser.
+ *
+ *	cc -O2 -o glfont-test glfont-test.c glfont.c rune.c \
+ *		$(pkg-config --cflags --libs freetype2 egl gl) -lm -lpthread
+ *	./glfont-test [-n frames] [-t threads] [-o out.pgm] font.ttf
+ *
+ * Every frame is drawn once string by string and once between
+ * begin_strings and end_strings; the two must come out the same.
+ * The time per frame of each way is printed, and the last frame
+ * can be written out as a PGM to look at.
+ *
+ * With -t, glyphs are rendered by that many threads. The first
+ * time a frame is drawn it may have gaps; it is timed and then
+ * drawn again when the threads are done. The last frame should
+ * come out the same as without threads.
+ *
+ * At the end one string of every character in the font, up to
+ * BURST of them, is drawn at once, which must not fill up the
+ * cache with glyphs still waiting for a thread.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "utf.h"
+
+enum { WIDTH = 800, HEIGHT = 600, BURST = 4200 };
+
+/* glfont.c */
+FT_Face load_font(char *fontname);
+void free_font(FT_Face face);
+void font_cache_frame(void);
+void start_font_threads(int n);
+void wait_font_threads(void);
+void stop_font_threads(void);
+void begin_strings(void);
+void end_strings(void);
+float draw_string(FT_Face face, float fsize, float x, float y, char *str);
+
+static char *lines[] = {
+	"In the population of Transylvania there are four",
+	"distinct nationalities: Saxons in the South,",
+	"and mixed with them the Wallachs, who are the",
+	"descendants of the Dacians; Magyars in the West,",
+	"and Szekelys in the East and North. I am going",
+	"among the latter, who claim to be descended from",
+	"Attila and the Huns. This may be so, for when",
+	"the Magyars conquered the country in the eleventh",
+	"century they found the Huns settled in it.",
+};
+
+#define nelem(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *msg)
+{
+	fprintf(stderr, "error: %s\n", msg);
+	exit(1);
+}
+
+/* a GL context on no surface at all, drawing into a renderbuffer */
+static void init_gl(void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getdisplay;
+	EGLDisplay dpy;
+	EGLContext ctx;
+	GLuint fb, rb;
+
+	getdisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (!getdisplay)
+		die("no EGL_EXT_platform_base");
+	dpy = getdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (!eglInitialize(dpy, NULL, NULL))
+		die("cannot initialize EGL");
+	eglBindAPI(EGL_OPENGL_API);
+	ctx = eglCreateContext(dpy, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+	if (!ctx || !eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx))
+		die("cannot make a GL context");
+
+	glGenFramebuffers(1, &fb);
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
+	glGenRenderbuffers(1, &rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rb);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		die("cannot make a framebuffer");
+
+	glViewport(0, 0, WIDTH, HEIGHT);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, WIDTH, HEIGHT, 0, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glClearColor(1, 1, 1, 1);
+	glColor3f(0, 0, 0);
+}
+
+/* a page of lines at sizes that change from frame to frame */
+static void draw_frame(FT_Face face, int frame)
+{
+	float y = 0, size;
+	int i;
+
+	glClear(GL_COLOR_BUFFER_BIT);
+	for (i = 0; y < HEIGHT; i++)
+	{
+		size = 10 + (i + frame) % 15;
+		y += size * 1.25;
+		draw_string(face, size, 10.5, y, lines[i % nelem(lines)]);
+	}
+	font_cache_frame();
+}
+
+/* as many different glyphs as the font has, in one string */
+static int draw_burst(FT_Face face)
+{
+	char *str, *p;
+	FT_ULong ucs;
+	FT_UInt gid;
+	Rune r;
+	int n = 0;
+
+	p = str = malloc(BURST * UTFmax + 1);
+	ucs = FT_Get_First_Char(face, &gid);
+	while (gid != 0 && n < BURST)
+	{
+		r = ucs;
+		p += runetochar(p, &r);
+		n ++;
+		ucs = FT_Get_Next_Char(face, ucs, &gid);
+	}
+	*p = 0;
+
+	glClear(GL_COLOR_BUFFER_BIT);
+	draw_string(face, 8, 0.5, 10, str);
+	font_cache_frame();
+	free(str);
+	return n;
+}
+
+static void read_frame(unsigned char *pixels)
+{
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+static void write_pgm(char *filename, unsigned char *pixels)
+{
+	FILE *f;
+	int x, y;
+
+	f = fopen(filename, "wb");
+	if (!f)
+		die("cannot create image");
+	fprintf(f, "P5\n%d %d\n255\n", WIDTH, HEIGHT);
+	for (y = HEIGHT - 1; y >= 0; y--)
+		for (x = 0; x < WIDTH; x++)
+			putc(pixels[(y * WIDTH + x) * 4], f);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *single, *batched;
+	double t, tsingle = 0, tbatched = 0, worst = 0;
+	char *out = NULL;
+	FT_Face face;
+	int frames = 100, threads = 0, bad = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n:t:o:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': frames = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'o': out = optarg; break;
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "usage: glfont-test [-n frames] [-t threads] [-o out.pgm] font.ttf\n");
+		return 1;
+	}
+
+	init_gl();
+	printf("%s\n", glGetString(GL_RENDERER));
+
+	face = load_font(argv[optind]);
+	single = malloc(WIDTH * HEIGHT * 4);
+	batched = malloc(WIDTH * HEIGHT * 4);
+	start_font_threads(threads);
+
+	for (i = 0; i < frames; i++)
+	{
+		t = now();
+		draw_frame(face, i);
+		glFinish();
+		t = now() - t;
+		tsingle += t;
+		if (t > worst)
+			worst = t;
+		if (threads > 0)
+		{
+			wait_font_threads();
+			draw_frame(face, i);
+		}
+		read_frame(single);
+
+		t = now();
+		begin_strings();
+		draw_frame(face, i);
+		end_strings();
+		glFinish();
+		tbatched += now() - t;
+		read_frame(batched);
+
+		if (memcmp(single, batched, WIDTH * HEIGHT * 4))
+			bad ++;
+	}
+
+	printf("%d frames: %.2f ms each string by string, %.2f ms batched\n",
+		frames, tsingle * 1e3 / frames, tbatched * 1e3 / frames);
+	printf("slowest frame string by string: %.2f ms\n", worst * 1e3);
+
+	t = now();
+	c = draw_burst(face);
+	glFinish();
+	printf("%d new glyphs in one string: %.2f ms\n", c, (now() - t) * 1e3);
+	if (bad)
+		printf("%d frames came out differently\n", bad);
+
+	if (out)
+		write_pgm(out, batched);
+
+	stop_font_threads();
+	free_font(face);
+	free(single);
+	free(batched);
+	return bad != 0;
+}
@@ -2,8 +2,28 @@
  * A very simple font cache and rasterizer that uses freetype
  * to draw fonts from a single OpenGL texture. The code uses
  * a linear-probe hashtable, and writes new glyphs into
- * the texture using glTexSubImage2D. When the texture fills
- * up, or the hash table gets too crowded, everything is wiped.
+ * the texture using glTexSubImage2D. The texture is cut into
+ * pages, each packed with a skyline. When no page has room
+ * for a glyph, or the hash table gets too crowded, the page
+ * that was drawn from least recently is wiped, so only cold
+ * glyphs have to be rendered again. Call font_cache_frame
+ * once per frame to keep track of what is recent.
+ *
+ * Glyphs are drawn into a client-side vertex array, and new
+ * bitmaps go into a copy of the texture in memory; both are
+ * sent to GL when the strings are flushed. A string is flushed
+ * when it is drawn, unless it is between begin_strings and
+ * end_strings, so a whole frame of text can go in one call.
+ *
+ * After start_font_threads, glyphs missing from the cache are
+ * rendered by worker threads, each with its own freetype library
+ * and faces. Until a glyph is ready its space is left blank,
+ * usually for one frame; the drawing thread only copies the
+ * finished bitmaps into the texture.
+ *
+ * Strings are laid out once per face and size: the glyphs and
+ * kerning of recent strings are kept, up to RUNBUDGET bytes, so
+ * labels drawn every frame do not go back to freetype.
  *
  * This is designed to be used for horizontal text only,
  * and draws unhinted text with subpixel accurate metrics
@@ -21,9 +41,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
 
-#include "opengl.h"
 #include "utf.h"
+#include "queue.h"
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -32,7 +59,14 @@
 #define PADDING 1		/* set to 0 to save some space but disallow arbitrary transforms */
 
 #define MAXGLYPHS 4093	/* prime number for hash table goodness */
-#define CACHESIZE 256
+#define MAXQUADS 4096	/* glyphs drawn in one go */
+#define MAXFONTS 32	/* fonts the threads can render from */
+#define MAXPENDING (MAXGLYPHS / 4)	/* glyphs left to the threads at once */
+#define MAXRUNS 1021	/* hash chains for laid out strings */
+#define RUNBUDGET (256 << 10)	/* bytes of laid out strings kept */
+#define CACHESIZE 1024
+#define PAGESIZE 256	/* unit of eviction */
+#define NPAGES ((CACHESIZE / PAGESIZE) * (CACHESIZE / PAGESIZE))
 #define XPRECISION 4
 #define YPRECISION 1
 
@@ -56,6 +90,8 @@ struct glyph
 	char lsb, top, w, h;
 	short s, t;
 	float advance;
+	short page;	/* -1 while a thread renders it */
+	int used;	/* last frame it was drawn in */
 };
 
 struct table
@@ -64,15 +100,96 @@ struct table
 	struct glyph glyph;
 };
 
+/* the top of the glyphs packed in a page, as horizontal segments */
+struct skyline
+{
+	short x, y, w;
+};
+
+struct vertex
+{
+	float s, t, x, y;
+};
+
+/* a loaded font, by file so that each thread can open its own */
+struct font
+{
+	FT_Face face;
+	char *filename;
+	int serial;
+};
+
+/* a glyph to render, and then the rendered bitmap */
+struct job
+{
+	struct key key;
+	int font, serial;
+	int w, h, lsb, top;
+	float advance;
+	unsigned char *bitmap;
+	SIMPLEQ_ENTRY(job) next;
+};
+
+SIMPLEQ_HEAD(jobqueue, job);
+
+/* a string laid out in a face at a size */
+struct run
+{
+	FT_Face face;
+	int size;
+	unsigned int hash;
+	int n, bytes;
+	float width;	/* with unhinted advances */
+	int *gids;
+	float *kerns;	/* pen movement before each glyph */
+	char *str;
+	LIST_ENTRY(run) chain;
+	TAILQ_ENTRY(run) lru;
+};
+
+LIST_HEAD(runlist, run);
+TAILQ_HEAD(runqueue, run);
+
+struct page
+{
+	short s, t;	/* corner in the texture */
+	int used;	/* last frame a glyph of it was drawn in */
+	int count;	/* glyphs in the table */
+	int nsky;
+	struct skyline sky[PAGESIZE];
+};
+
 static FT_Library g_freetype_lib = NULL;
 static struct table g_table[MAXGLYPHS];
 static int g_table_load = 0;
 static unsigned int g_cache_tex = 0;
 static int g_cache_w = CACHESIZE;
 static int g_cache_h = CACHESIZE;
-static int g_cache_row_y = 0;
-static int g_cache_row_x = 0;
-static int g_cache_row_h = 0;
+static struct page g_pages[NPAGES];
+static int g_frame = 1;
+static unsigned char *g_cache_pixels = NULL;	/* what the texture will hold */
+static int g_dirty_x0, g_dirty_y0, g_dirty_x1, g_dirty_y1;	/* and where it does not yet */
+static struct vertex g_verts[MAXQUADS * 4];
+static int g_nverts = 0;
+static int g_batching = 0;
+
+static struct font g_fonts[MAXFONTS];
+static int g_font_serial = 0;
+static pthread_t *g_threads = NULL;
+static int g_nthreads = 0;
+static int g_quit = 0;
+static int g_busy = 0;	/* jobs being rendered */
+static int g_pending = 0;	/* table entries waiting for a thread */
+static struct jobqueue g_jobs = SIMPLEQ_HEAD_INITIALIZER(g_jobs);
+static struct jobqueue g_done = SIMPLEQ_HEAD_INITIALIZER(g_done);
+static pthread_mutex_t g_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_job_cond = PTHREAD_COND_INITIALIZER;	/* a job queued, or quit */
+static pthread_cond_t g_done_cond = PTHREAD_COND_INITIALIZER;	/* a job done */
+
+static struct runlist g_runs[MAXRUNS];
+static struct runqueue g_run_lru = TAILQ_HEAD_INITIALIZER(g_run_lru);	/* most recent first */
+static struct run *g_bigrun = NULL;	/* last string too long to keep */
+static int g_run_bytes = 0;
 
 static void init_font_cache(void)
 {
@@ -89,30 +206,108 @@ static void init_font_cache(void)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, g_cache_w, g_cache_h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+
+	g_cache_pixels = malloc(g_cache_w * g_cache_h);
+	if (!g_cache_pixels)
+		die("cannot allocate font cache");
+}
+
+static void mark_dirty(int x, int y, int w, int h)
+{
+	if (g_dirty_x0 >= g_dirty_x1)
+	{
+		g_dirty_x0 = x; g_dirty_y0 = y;
+		g_dirty_x1 = x + w; g_dirty_y1 = y + h;
+		return;
+	}
+	if (g_dirty_x0 > x) g_dirty_x0 = x;
+	if (g_dirty_y0 > y) g_dirty_y0 = y;
+	if (g_dirty_x1 < x + w) g_dirty_x1 = x + w;
+	if (g_dirty_y1 < y + h) g_dirty_y1 = y + h;
+}
+
+/*
+ * Upload the new bitmaps, then draw the glyphs waiting in the
+ * vertex array with them.
+ */
+static void flush_strings(void)
+{
+	glBindTexture(GL_TEXTURE_2D, g_cache_tex);
+
+	if (g_dirty_x0 < g_dirty_x1)
+	{
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, g_cache_w);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, g_dirty_x0, g_dirty_y0,
+				g_dirty_x1 - g_dirty_x0, g_dirty_y1 - g_dirty_y0, GL_ALPHA, GL_UNSIGNED_BYTE,
+				g_cache_pixels + g_dirty_y0 * g_cache_w + g_dirty_x0);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		g_dirty_x0 = g_dirty_x1 = 0;
+	}
+
+	if (g_nverts == 0)
+		return;
+
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(struct vertex), &g_verts[0].s);
+	glVertexPointer(2, GL_FLOAT, sizeof(struct vertex), &g_verts[0].x);
+	glDrawArrays(GL_QUADS, 0, g_nverts);
+	glPopClientAttrib();
+
+	g_nverts = 0;
+}
+
+void begin_strings(void)
+{
+	g_batching = 1;
+}
+
+void end_strings(void)
+{
+	flush_strings();
+	g_batching = 0;
 }
 
 static void clear_font_cache(void)
 {
+	int i;
+
+	flush_strings();
+
+	memset(g_cache_pixels, 0, g_cache_w * g_cache_h);
 #if PADDING > 0
-	unsigned char *zero = malloc(g_cache_w * g_cache_h);
-	memset(zero, 0, g_cache_w * g_cache_h);
-	glBindTexture(GL_TEXTURE_2D, g_cache_tex);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, g_cache_w, g_cache_h, GL_ALPHA, GL_UNSIGNED_BYTE, zero);
-	free(zero);
+	mark_dirty(0, 0, g_cache_w, g_cache_h);
 #endif
 
 	memset(g_table, 0, sizeof(g_table));
 	g_table_load = 0;
+	g_pending = 0;
 
-	g_cache_row_y = PADDING;
-	g_cache_row_x = PADDING;
-	g_cache_row_h = 0;
+	for (i = 0; i < NPAGES; i++)
+	{
+		g_pages[i].s = (i % (CACHESIZE / PAGESIZE)) * PAGESIZE;
+		g_pages[i].t = (i / (CACHESIZE / PAGESIZE)) * PAGESIZE;
+		g_pages[i].used = 0;
+		g_pages[i].count = 0;
+		g_pages[i].nsky = 1;
+		g_pages[i].sky[0].x = PADDING;
+		g_pages[i].sky[0].y = PADDING;
+		g_pages[i].sky[0].w = PAGESIZE - PADDING;
+	}
+}
+
+/* glyphs drawn after this are more recent than those drawn before */
+void font_cache_frame(void)
+{
+	g_frame ++;
 }
 
 FT_Face load_font(char *fontname)
 {
 	FT_Face face;
-	int code;
+	int code, i;
 
 	if (g_freetype_lib == NULL)
 	{
@@ -126,12 +321,76 @@ FT_Face load_font(char *fontname)
 
 	FT_Select_Charmap(face, ft_encoding_unicode);
 
+	/* fonts past MAXFONTS are always rendered here */
+	pthread_mutex_lock(&g_job_lock);
+	for (i = 0; i < MAXFONTS; i++)
+	{
+		if (!g_fonts[i].face)
+		{
+			g_fonts[i].face = face;
+			g_fonts[i].filename = strdup(fontname);
+			if (!g_fonts[i].filename)
+				die("cannot allocate font file name");
+			g_fonts[i].serial = ++g_font_serial;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_job_lock);
+
 	return face;
 }
 
+static void remove_run(struct run *run)
+{
+	LIST_REMOVE(run, chain);
+	TAILQ_REMOVE(&g_run_lru, run, lru);
+	g_run_bytes -= run->bytes;
+	free(run);
+}
+
 void free_font(FT_Face face)
 {
+	struct jobqueue keep = SIMPLEQ_HEAD_INITIALIZER(keep);
+	struct run *run, *tmp;
+	struct job *job;
+	int i;
+
 	clear_font_cache();
+
+	TAILQ_FOREACH_SAFE(run, &g_run_lru, lru, tmp)
+		if (run->face == face)
+			remove_run(run);
+	free(g_bigrun);
+	g_bigrun = NULL;
+
+	/* drop its waiting jobs; finished ones are dropped as stale */
+	pthread_mutex_lock(&g_job_lock);
+	while (!SIMPLEQ_EMPTY(&g_jobs))
+	{
+		job = SIMPLEQ_FIRST(&g_jobs);
+		SIMPLEQ_REMOVE_HEAD(&g_jobs, next);
+		if (job->key.face == face)
+			free(job);
+		else
+			SIMPLEQ_INSERT_TAIL(&keep, job, next);
+	}
+	while (!SIMPLEQ_EMPTY(&keep))
+	{
+		job = SIMPLEQ_FIRST(&keep);
+		SIMPLEQ_REMOVE_HEAD(&keep, next);
+		SIMPLEQ_INSERT_TAIL(&g_jobs, job, next);
+	}
+	for (i = 0; i < MAXFONTS; i++)
+	{
+		if (g_fonts[i].face == face)
+		{
+			free(g_fonts[i].filename);
+			g_fonts[i].face = NULL;
+			g_fonts[i].filename = NULL;
+		}
+	}
+	pthread_mutex_unlock(&g_job_lock);
+
 	FT_Done_Face(face);
 }
 
@@ -148,7 +407,8 @@ static unsigned int hashfunc(struct key *key)
 static unsigned int lookup_table(struct key *key)
 {
 	unsigned int pos = hashfunc(key) % MAXGLYPHS;
-	while (1)
+	int n;
+	for (n = 0; n < MAXGLYPHS; n++)
 	{
 		if (!g_table[pos].key.face) /* empty slot */
 			return pos;
@@ -156,106 +416,545 @@ static unsigned int lookup_table(struct key *key)
 			return pos;
 		pos = (pos + 1) % MAXGLYPHS;
 	}
+	die("glyph cache table is full");
+	return 0;
 }
 
-static struct glyph * lookup_glyph(FT_Face face, int size, int gid, int subx, int suby)
+/*
+ * Empty a slot and move later entries of its cluster back into the
+ * hole, so that lookups never need to step over deleted entries.
+ */
+static void remove_table(unsigned int pos)
 {
-	FT_Vector subv;
-	struct key key;
-	unsigned int pos;
-	int code;
-	int w, h;
+	unsigned int hole = pos, home;
 
-	/*
-	 * Look it up in the table
-	 */
+	while (1)
+	{
+		pos = (pos + 1) % MAXGLYPHS;
+		if (!g_table[pos].key.face)
+			break;
+		home = hashfunc(&g_table[pos].key) % MAXGLYPHS;
+		/* leave it if its home is cyclically in (hole, pos] */
+		if (hole <= pos ? (home > hole && home <= pos) : (home > hole || home <= pos))
+			continue;
+		g_table[hole] = g_table[pos];
+		hole = pos;
+	}
 
-	key.face = face;
-	key.size = size;
-	key.gid = gid;
-	key.subx = subx;
-	key.suby = suby;
+	memset(&g_table[hole], 0, sizeof(struct table));
+	g_table_load --;
+}
 
-	pos = lookup_table(&key);
-	if (g_table[pos].key.face)
-		return &g_table[pos].glyph;
+/*
+ * Throw out every glyph of a page and start packing it afresh.
+ */
+static void evict_page(int p)
+{
+	struct page *page = &g_pages[p];
+	unsigned int pos = 0;
+	int y;
 
-	/*
-	 * Render the bitmap
-	 */
+	/* glyphs waiting to be drawn may be from this page */
+	flush_strings();
+
+	while (pos < MAXGLYPHS && page->count > 0)
+	{
+		if (g_table[pos].key.face && g_table[pos].glyph.page == p)
+		{
+			remove_table(pos);
+			page->count --;
+		}
+		else
+			pos ++;
+	}
+
+#if PADDING > 0
+	for (y = 0; y < PAGESIZE; y++)
+		memset(g_cache_pixels + (page->t + y) * g_cache_w + page->s, 0, PAGESIZE);
+	mark_dirty(page->s, page->t, PAGESIZE, PAGESIZE);
+#endif
+
+	page->used = 0;
+	page->count = 0;
+	page->nsky = 1;
+	page->sky[0].x = PADDING;
+	page->sky[0].y = PADDING;
+	page->sky[0].w = PAGESIZE - PADDING;
+}
+
+/* the least recently drawn page, of those with glyphs if full is set */
+static int oldest_page(int full)
+{
+	int i, p = -1;
+	for (i = 0; i < NPAGES; i++)
+	{
+		if (full && g_pages[i].count == 0)
+			continue;
+		if (p < 0 || g_pages[i].used < g_pages[p].used)
+			p = i;
+	}
+	return p;
+}
+
+/*
+ * The lowest place a w by h box fits resting on the skyline from
+ * segment i on, or -1.
+ */
+static int skyline_fits(struct page *page, int i, int w, int h)
+{
+	int x = page->sky[i].x;
+	int y = page->sky[i].y;
+	int left = w;
+
+	if (x + w > PAGESIZE)
+		return -1;
+	while (left > 0)
+	{
+		if (i == page->nsky)
+			return -1;
+		if (y < page->sky[i].y)
+			y = page->sky[i].y;
+		if (y + h > PAGESIZE)
+			return -1;
+		left -= page->sky[i].w;
+		i ++;
+	}
+	return y;
+}
+
+/* put a box on segment i, and cut back the segments it covers */
+static void skyline_add(struct page *page, int i, int x, int y, int w, int h)
+{
+	struct skyline *sky = page->sky;
+	int k, cut;
+
+	memmove(&sky[i + 1], &sky[i], (page->nsky - i) * sizeof(struct skyline));
+	sky[i].x = x;
+	sky[i].y = y + h;
+	sky[i].w = w;
+	page->nsky ++;
+
+	for (k = i + 1; k < page->nsky; k++)
+	{
+		if (sky[k].x >= sky[k - 1].x + sky[k - 1].w)
+			break;
+		cut = sky[k - 1].x + sky[k - 1].w - sky[k].x;
+		sky[k].x += cut;
+		sky[k].w -= cut;
+		if (sky[k].w > 0)
+			break;
+		memmove(&sky[k], &sky[k + 1], (page->nsky - k - 1) * sizeof(struct skyline));
+		page->nsky --;
+		k --;
+	}
+
+	for (k = 0; k < page->nsky - 1; k++)
+	{
+		if (sky[k].y == sky[k + 1].y)
+		{
+			sky[k].w += sky[k + 1].w;
+			memmove(&sky[k + 1], &sky[k + 2], (page->nsky - k - 2) * sizeof(struct skyline));
+			page->nsky --;
+			k --;
+		}
+	}
+}
+
+/* find the lowest, then narrowest, place for a box in a page */
+static int pack_page(struct page *page, int w, int h, int *x, int *y)
+{
+	int i, fy, best = -1, besth = PAGESIZE + 1, bestw = PAGESIZE + 1;
+
+	for (i = 0; i < page->nsky; i++)
+	{
+		fy = skyline_fits(page, i, w, h);
+		if (fy < 0)
+			continue;
+		if (fy + h < besth || (fy + h == besth && page->sky[i].w < bestw))
+		{
+			best = i;
+			besth = fy + h;
+			bestw = page->sky[i].w;
+			*x = page->sky[i].x;
+			*y = fy;
+		}
+	}
+
+	if (best < 0)
+		return 0;
+	skyline_add(page, best, *x, *y, w, h);
+	return 1;
+}
+
+/* find room for a glyph, evicting the oldest page if there is none */
+static int pack_glyph(int w, int h, int *x, int *y)
+{
+	int p;
+
+	for (p = 0; p < NPAGES; p++)
+		if (pack_page(&g_pages[p], w, h, x, y))
+			return p;
+
+	p = oldest_page(0);
+	evict_page(p);
+	if (!pack_page(&g_pages[p], w, h, x, y))
+		die("rendered glyph exceeds cache page dimensions");
+	return p;
+}
+
+/*
+ * Render a glyph into a job's bitmap, on any thread with its own face.
+ */
+static int render_glyph(FT_Face face, struct job *job)
+{
+	FT_Vector subv;
+	int code;
+	int y;
 
-	glEnd();
+	FT_Set_Char_Size(face, job->key.size, job->key.size, 72, 72);
 
-	subv.x = subx;
-	subv.y = suby;
+	subv.x = job->key.subx;
+	subv.y = job->key.suby;
 
 	FT_Set_Transform(face, NULL, &subv);
 
-	code = FT_Load_Glyph(face, gid, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING);
+	code = FT_Load_Glyph(face, job->key.gid, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING);
 	if (code < 0)
-		return NULL;
+		return -1;
 
 	code = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_LIGHT);
 	if (code < 0)
-		return NULL;
+		return -1;
 
-	w = face->glyph->bitmap.width;
-	h = face->glyph->bitmap.rows;
+	job->w = face->glyph->bitmap.width;
+	job->h = face->glyph->bitmap.rows;
+	job->lsb = face->glyph->bitmap_left;
+	job->top = face->glyph->bitmap_top;
+	job->advance = face->glyph->advance.x / 64.0;
+
+	job->bitmap = malloc(job->w * job->h + 1);
+	if (!job->bitmap)
+		die("cannot allocate glyph bitmap");
+	for (y = 0; y < job->h; y++)
+		memcpy(job->bitmap + y * job->w, face->glyph->bitmap.buffer + y * face->glyph->bitmap.pitch, job->w);
+
+	return 0;
+}
+
+/*
+ * Find room for a rendered glyph and copy it into the texture.
+ * It counts as drawn in frame used, so that glyphs finished late
+ * do not look more recent than what the current frame draws.
+ */
+static struct glyph * place_glyph(struct job *job, int used)
+{
+	unsigned int pos;
+	int page, x, y;
+	int w = job->w;
+	int h = job->h;
 
 	/*
 	 * Find an empty slot in the texture
 	 */
 
-	if (g_table_load == (MAXGLYPHS * 3) / 4)
+	if (h + PADDING > PAGESIZE || w + PADDING > PAGESIZE)
+		die("rendered glyph exceeds cache page dimensions");
+
+	pos = lookup_table(&job->key);
+	if (!g_table[pos].key.face && g_table_load >= (MAXGLYPHS * 3) / 4)
 	{
-		puts("font cache table full, clearing cache");
-		clear_font_cache();
-		pos = lookup_table(&key);
+		page = oldest_page(1);
+		if (page >= 0)
+			evict_page(page);
 	}
 
-	if (h + PADDING > g_cache_h || w + PADDING > g_cache_w)
-		die("rendered glyph exceeds cache dimensions");
+	page = pack_glyph(w + PADDING, h + PADDING, &x, &y);
+	pos = lookup_table(&job->key);
+	if (!g_table[pos].key.face)
+		g_table_load ++;
+
+	/*
+	 * Copy bitmap into texture
+	 */
+
+	memcpy(&g_table[pos].key, &job->key, sizeof(struct key));
+	g_table[pos].glyph.w = w;
+	g_table[pos].glyph.h = h;
+	g_table[pos].glyph.lsb = job->lsb;
+	g_table[pos].glyph.top = job->top;
+	g_table[pos].glyph.s = g_pages[page].s + x;
+	g_table[pos].glyph.t = g_pages[page].t + y;
+	g_table[pos].glyph.advance = job->advance;
+	g_table[pos].glyph.page = page;
+	g_table[pos].glyph.used = used;
+	if (g_pages[page].used < used)
+		g_pages[page].used = used;
+	g_pages[page].count ++;
+
+	for (y = 0; y < h; y++)
+		memcpy(g_cache_pixels + (g_table[pos].glyph.t + y) * g_cache_w + g_table[pos].glyph.s,
+			job->bitmap + y * w, w);
+	mark_dirty(g_table[pos].glyph.s, g_table[pos].glyph.t, w, h);
+
+	return &g_table[pos].glyph;
+}
+
+static int find_font(FT_Face face)
+{
+	int i;
+	for (i = 0; i < MAXFONTS; i++)
+		if (g_fonts[i].face == face)
+			return i;
+	return -1;
+}
+
+static struct glyph * lookup_glyph(FT_Face face, int size, int gid, int subx, int suby)
+{
+	FT_Fixed advance = 0;
+	struct glyph *glyph;
+	struct job job, *queued;
+	unsigned int pos;
+	int font, page;
+
+	/*
+	 * Look it up in the table
+	 */
 
-	if (g_cache_row_x + w + PADDING > g_cache_w)
+	memset(&job, 0, sizeof(job));
+	job.key.face = face;
+	job.key.size = size;
+	job.key.gid = gid;
+	job.key.subx = subx;
+	job.key.suby = suby;
+
+	pos = lookup_table(&job.key);
+	if (g_table[pos].key.face)
 	{
-		g_cache_row_y += g_cache_row_h + PADDING;
-		g_cache_row_x = PADDING;
-		g_cache_row_h = 0;
+		g_table[pos].glyph.used = g_frame;
+		if (g_table[pos].glyph.page >= 0)
+			g_pages[g_table[pos].glyph.page].used = g_frame;
+		return &g_table[pos].glyph;
 	}
-	if (g_cache_row_y + h + PADDING > g_cache_h)
+
+	/*
+	 * Leave it to a thread, and keep its place until it is done;
+	 * past MAXPENDING, render it here so that a burst of new
+	 * glyphs cannot fill the table with placeholders
+	 */
+
+	font = find_font(face);
+	if (g_nthreads > 0 && font >= 0 && g_pending < MAXPENDING)
 	{
-		puts("font cache texture full, clearing cache");
-		clear_font_cache();
-		pos = lookup_table(&key);
+		if (g_table_load >= (MAXGLYPHS * 3) / 4)
+		{
+			page = oldest_page(1);
+			if (page >= 0)
+				evict_page(page);
+			pos = lookup_table(&job.key);
+		}
+
+		/* as FT_Load_Glyph would have it, in 26.6 */
+		FT_Set_Char_Size(face, size, size, 72, 72);
+		if (FT_Get_Advance(face, gid, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING, &advance))
+			advance = 0;
+		advance = (advance + 512) >> 10;
+
+		memcpy(&g_table[pos].key, &job.key, sizeof(struct key));
+		memset(&g_table[pos].glyph, 0, sizeof(struct glyph));
+		g_table[pos].glyph.advance = advance / 64.0;
+		g_table[pos].glyph.page = -1;
+		g_table[pos].glyph.used = g_frame;
+		g_table_load ++;
+		g_pending ++;
+
+		queued = malloc(sizeof(struct job));
+		if (!queued)
+			die("cannot allocate glyph job");
+		memcpy(queued, &job, sizeof(struct job));
+		queued->font = font;
+		queued->serial = g_fonts[font].serial;
+
+		pthread_mutex_lock(&g_job_lock);
+		SIMPLEQ_INSERT_TAIL(&g_jobs, queued, next);
+		pthread_cond_signal(&g_job_cond);
+		pthread_mutex_unlock(&g_job_lock);
+
+		return &g_table[pos].glyph;
 	}
 
 	/*
-	 * Copy bitmap into texture
+	 * Render the bitmap
 	 */
 
-	memcpy(&g_table[pos].key, &key, sizeof(struct key));
-	g_table[pos].glyph.w = face->glyph->bitmap.width;
-	g_table[pos].glyph.h = face->glyph->bitmap.rows;
-	g_table[pos].glyph.lsb = face->glyph->bitmap_left;
-	g_table[pos].glyph.top = face->glyph->bitmap_top;
-	g_table[pos].glyph.s = g_cache_row_x;
-	g_table[pos].glyph.t = g_cache_row_y;
-	g_table[pos].glyph.advance = face->glyph->advance.x / 64.0;
-	g_table_load ++;
+	if (render_glyph(face, &job) < 0)
+		return NULL;
+	glyph = place_glyph(&job, g_frame);
+	free(job.bitmap);
 
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, face->glyph->bitmap.pitch);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, g_cache_row_x, g_cache_row_y, w, h,
-			GL_ALPHA, GL_UNSIGNED_BYTE, face->glyph->bitmap.buffer);
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	return glyph;
+}
 
-	glBegin(GL_QUADS);
+/*
+ * Put the glyphs the threads have finished in the texture, unless
+ * their font or the cache was thrown out in the meantime.
+ */
+static void collect_glyphs(void)
+{
+	struct job *job;
+	unsigned int pos;
 
-	g_cache_row_x += w + PADDING;
-	if (g_cache_row_h < h + PADDING)
-		g_cache_row_h = h + PADDING;
+	if (g_nthreads == 0)
+		return;
 
-	return &g_table[pos].glyph;
+	while (1)
+	{
+		pthread_mutex_lock(&g_job_lock);
+		job = SIMPLEQ_FIRST(&g_done);
+		if (job)
+			SIMPLEQ_REMOVE_HEAD(&g_done, next);
+		pthread_mutex_unlock(&g_job_lock);
+		if (!job)
+			break;
+
+		pos = lookup_table(&job->key);
+		if (g_fonts[job->font].serial == job->serial &&
+			g_table[pos].key.face && g_table[pos].glyph.page < 0)
+		{
+			/* a glyph that failed keeps its place */
+			if (!job->bitmap)
+				job->advance = g_table[pos].glyph.advance;
+			g_pending --;
+			place_glyph(job, g_table[pos].glyph.used);
+		}
+
+		free(job->bitmap);
+		free(job);
+	}
+}
+
+static void *font_thread(void *arg)
+{
+	FT_Library lib;
+	FT_Face faces[MAXFONTS];
+	int serials[MAXFONTS];
+	struct job *job;
+	char *filename;
+	int i;
+
+	(void)arg;
+
+	if (FT_Init_FreeType(&lib))
+		die("cannot initialize freetype");
+	memset(faces, 0, sizeof(faces));
+	memset(serials, 0, sizeof(serials));
+
+	pthread_mutex_lock(&g_job_lock);
+	while (1)
+	{
+		while (SIMPLEQ_EMPTY(&g_jobs) && !g_quit)
+			pthread_cond_wait(&g_job_cond, &g_job_lock);
+		if (g_quit)
+			break;
+
+		job = SIMPLEQ_FIRST(&g_jobs);
+		SIMPLEQ_REMOVE_HEAD(&g_jobs, next);
+		g_busy ++;
+
+		/* the font is loaded while it has jobs waiting */
+		filename = NULL;
+		if (serials[job->font] != job->serial)
+		{
+			filename = strdup(g_fonts[job->font].filename);
+			if (!filename)
+				die("cannot allocate font file name");
+		}
+		pthread_mutex_unlock(&g_job_lock);
+
+		if (filename)
+		{
+			if (faces[job->font])
+				FT_Done_Face(faces[job->font]);
+			faces[job->font] = NULL;
+			if (!FT_New_Face(lib, filename, 0, &faces[job->font]))
+				FT_Select_Charmap(faces[job->font], ft_encoding_unicode);
+			else
+				faces[job->font] = NULL;
+			serials[job->font] = job->serial;
+			free(filename);
+		}
+
+		/* a glyph that cannot be rendered is cached as blank */
+		if (!faces[job->font] || render_glyph(faces[job->font], job) < 0)
+		{
+			job->w = job->h = 0;
+			job->lsb = job->top = 0;
+			job->advance = 0;
+			job->bitmap = NULL;
+		}
+
+		pthread_mutex_lock(&g_job_lock);
+		SIMPLEQ_INSERT_TAIL(&g_done, job, next);
+		g_busy --;
+		pthread_cond_broadcast(&g_done_cond);
+	}
+	pthread_mutex_unlock(&g_job_lock);
+
+	for (i = 0; i < MAXFONTS; i++)
+		if (faces[i])
+			FT_Done_Face(faces[i]);
+	FT_Done_FreeType(lib);
+	return NULL;
+}
+
+/* render glyphs missing from the cache on n threads from now on */
+void start_font_threads(int n)
+{
+	int i;
+
+	if (g_nthreads > 0 || n <= 0)
+		return;
+
+	g_threads = malloc(n * sizeof(pthread_t));
+	if (!g_threads)
+		die("cannot allocate font threads");
+	g_quit = 0;
+	for (i = 0; i < n; i++)
+		if (pthread_create(&g_threads[i], NULL, font_thread, NULL))
+			die("cannot start font thread");
+	g_nthreads = n;
+}
+
+/* wait for every glyph asked for so far, and put them in the texture */
+void wait_font_threads(void)
+{
+	pthread_mutex_lock(&g_job_lock);
+	while (!SIMPLEQ_EMPTY(&g_jobs) || g_busy > 0)
+		pthread_cond_wait(&g_done_cond, &g_job_lock);
+	pthread_mutex_unlock(&g_job_lock);
+
+	collect_glyphs();
+}
+
+/* go back to rendering glyphs when they are drawn */
+void stop_font_threads(void)
+{
+	int i;
+
+	if (g_nthreads == 0)
+		return;
+
+	wait_font_threads();
+
+	pthread_mutex_lock(&g_job_lock);
+	g_quit = 1;
+	pthread_cond_broadcast(&g_job_cond);
+	pthread_mutex_unlock(&g_job_lock);
+
+	for (i = 0; i < g_nthreads; i++)
+		pthread_join(g_threads[i], NULL);
+	free(g_threads);
+	g_threads = NULL;
+	g_nthreads = 0;
 }
 
 static float draw_glyph(FT_Face face, int size, int gid, float x, float y)
@@ -269,6 +968,8 @@ static float draw_glyph(FT_Face face, int size, int gid, float x, float y)
 	glyph = lookup_glyph(face, size, gid, subx, suby);
 	if (!glyph)
 		return 0.0;
+	if (glyph->page < 0)
+		return glyph->advance;
 
 	float s0 = (float) glyph->s / g_cache_w;
 	float t0 = (float) glyph->t / g_cache_h;
@@ -277,62 +978,131 @@ static float draw_glyph(FT_Face face, int size, int gid, float x, float y)
 	float xc = floor(x) + glyph->lsb;
 	float yc = floor(y) - glyph->top + glyph->h;
 
-	glTexCoord2f(s0, t0); glVertex2f(xc, yc - glyph->h);
-	glTexCoord2f(s1, t0); glVertex2f(xc + glyph->w, yc - glyph->h);
-	glTexCoord2f(s1, t1); glVertex2f(xc + glyph->w, yc);
-	glTexCoord2f(s0, t1); glVertex2f(xc, yc);
+	if (g_nverts == MAXQUADS * 4)
+		flush_strings();
+
+	struct vertex *v = &g_verts[g_nverts];
+	v[0].s = s0; v[0].t = t0; v[0].x = xc; v[0].y = yc - glyph->h;
+	v[1].s = s1; v[1].t = t0; v[1].x = xc + glyph->w; v[1].y = yc - glyph->h;
+	v[2].s = s1; v[2].t = t1; v[2].x = xc + glyph->w; v[2].y = yc;
+	v[3].s = s0; v[3].t = t1; v[3].x = xc; v[3].y = yc;
+	g_nverts += 4;
 
 	return glyph->advance;
 }
 
-float measure_string(FT_Face face, float fsize, char *str)
+static unsigned int hashstring(FT_Face face, int size, char *str)
 {
-	int size = fsize * 64;
+	unsigned int h = size;
+	unsigned char *buf = (unsigned char *)&face;
+	unsigned int len = sizeof(FT_Face);
+	while (len--)
+		h = *buf++ + (h << 6) + (h << 16) - h;
+	for (buf = (unsigned char *)str; *buf; buf++)
+		h = *buf + (h << 6) + (h << 16) - h;
+	return h;
+}
+
+/*
+ * Find or make the layout of a string. Recent ones are kept, and
+ * the least recently used are thrown out past RUNBUDGET bytes.
+ */
+static struct run * shape_string(FT_Face face, int size, char *str)
+{
+	unsigned int hash = hashstring(face, size, str);
+	struct runlist *chain = &g_runs[hash % MAXRUNS];
+	struct run *run;
 	FT_Fixed advance;
 	FT_Vector kern;
 	Rune ucs, gid;
-	float w = 0.0;
 	int left = 0;
+	int len, bytes;
+	char *s;
+
+	LIST_FOREACH(run, chain, chain)
+	{
+		if (run->hash == hash && run->face == face && run->size == size && !strcmp(run->str, str))
+		{
+			TAILQ_REMOVE(&g_run_lru, run, lru);
+			TAILQ_INSERT_HEAD(&g_run_lru, run, lru);
+			return run;
+		}
+	}
+
+	/* no more glyphs than bytes */
+	len = strlen(str);
+	bytes = sizeof(struct run) + len * (sizeof(int) + sizeof(float)) + len + 1;
+	run = malloc(bytes);
+	if (!run)
+		die("cannot allocate string layout");
+	run->face = face;
+	run->size = size;
+	run->hash = hash;
+	run->n = 0;
+	run->bytes = bytes;
+	run->width = 0.0;
+	run->gids = (int *)(run + 1);
+	run->kerns = (float *)(run->gids + len);
+	run->str = (char *)(run->kerns + len);
+	memcpy(run->str, str, len + 1);
 
 	FT_Set_Char_Size(face, size, size, 72, 72);
 
-	while (*str)
+	s = str;
+	while (*s)
 	{
-		str += chartorune(&ucs, str);
+		s += chartorune(&ucs, s);
 		gid = FT_Get_Char_Index(face, ucs);
 		FT_Get_Kerning(face, left, gid, FT_KERNING_UNFITTED, &kern);
-		w += kern.x / 64.0;
-		FT_Get_Advance(face, gid, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING, &advance);
-		w += advance / 65536.0;
+		run->width += kern.x / 64.0;
+		if (FT_Get_Advance(face, gid, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING, &advance))
+			advance = 0;
+		run->width += advance / 65536.0;
+		run->gids[run->n] = gid;
+		run->kerns[run->n] = kern.x / 64.0;
+		run->n ++;
 		left = gid;
 	}
 
-	return w;
+	/* a long text would wipe out the labels the cache is for */
+	if (bytes > RUNBUDGET / 16)
+	{
+		free(g_bigrun);
+		g_bigrun = run;
+		return run;
+	}
+
+	LIST_INSERT_HEAD(chain, run, chain);
+	TAILQ_INSERT_HEAD(&g_run_lru, run, lru);
+	g_run_bytes += bytes;
+	while (g_run_bytes > RUNBUDGET)
+		remove_run(TAILQ_LAST(&g_run_lru, runqueue));
+
+	return run;
+}
+
+float measure_string(FT_Face face, float fsize, char *str)
+{
+	return shape_string(face, fsize * 64, str)->width;
 }
 
 float draw_string(FT_Face face, float fsize, float x, float y, char *str)
 {
 	int size = fsize * 64;
-	FT_Vector kern;
-	Rune ucs, gid;
-	int left = 0;
-
-	FT_Set_Char_Size(face, size, size, 72, 72);
+	struct run *run;
+	int i;
 
-	glBindTexture(GL_TEXTURE_2D, g_cache_tex);
-	glBegin(GL_QUADS);
+	collect_glyphs();
 
-	while (*str)
+	run = shape_string(face, size, str);
+	for (i = 0; i < run->n; i++)
 	{
-		str += chartorune(&ucs, str);
-		gid = FT_Get_Char_Index(face, ucs);
-		FT_Get_Kerning(face, left, gid, FT_KERNING_UNFITTED, &kern);
-		x += kern.x / 64.0;
-		x += draw_glyph(face, size, gid, x, y);
-		left = gid;
+		x += run->kerns[i];
+		x += draw_glyph(face, size, run->gids[i], x, y);
 	}
 
-	glEnd();
+	if (!g_batching)
+		flush_strings();
 
 	return x;
 }
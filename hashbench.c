@@ -0,0 +1,139 @@
+/*
+ * Benchmark the hash table variants against each other.
+ *
+ *	cc -O2 -o hashbench hashbench.c hashtable.c hashrobin.c hashswiss.c
+ *	./hashbench [count]
+ *
+ * Each table is filled with count string keys, then timed on lookups
+ * that all hit, lookups that all miss, and a mixed workload of hits,
+ * misses and a steady churn of removes and re-inserts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "hashrobin.h"
+#include "hashswiss.h"
+
+enum { KEYLEN = 12 };
+
+static int count = 1000000;
+static char (*present)[KEYLEN];
+static char (*absent)[KEYLEN];
+static int *order;
+static void *volatile sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned rnd(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void makekeys(void)
+{
+	unsigned seed = 1;
+	int i, k, t;
+
+	present = malloc(count * sizeof *present);
+	absent = malloc(count * sizeof *absent);
+	order = malloc(count * sizeof *order);
+
+	for (i = 0; i < count; i++)
+	{
+		snprintf(present[i], KEYLEN, "k%010d", i * 2);
+		snprintf(absent[i], KEYLEN, "k%010d", i * 2 + 1);
+		order[i] = i;
+	}
+
+	/* look keys up in a different order than they were inserted */
+	for (i = count - 1; i > 0; i--)
+	{
+		k = rnd(&seed) % (i + 1);
+		t = order[i]; order[i] = order[k]; order[k] = t;
+	}
+}
+
+#define BENCH(NAME, TYPE, INIT, FIND, INSERT, REMOVE, FREE) \
+static void bench_##NAME(void) \
+{ \
+	TYPE table; \
+	unsigned seed = 2; \
+	double t0, tins, thit, tmiss, tmix; \
+	int i, k, r; \
+	\
+	INIT; \
+	t0 = now(); \
+	for (i = 0; i < count; i++) \
+		INSERT(&table, present[i], KEYLEN, present[i]); \
+	tins = now() - t0; \
+	\
+	t0 = now(); \
+	for (i = 0; i < count; i++) \
+		sink = FIND(&table, present[order[i]], KEYLEN); \
+	thit = now() - t0; \
+	\
+	t0 = now(); \
+	for (i = 0; i < count; i++) \
+		sink = FIND(&table, absent[order[i]], KEYLEN); \
+	tmiss = now() - t0; \
+	\
+	t0 = now(); \
+	for (i = 0; i < count; i++) \
+	{ \
+		k = order[i]; \
+		r = rnd(&seed) % 10; \
+		if (r < 4) \
+			sink = FIND(&table, present[k], KEYLEN); \
+		else if (r < 8) \
+			sink = FIND(&table, absent[k], KEYLEN); \
+		else \
+		{ \
+			REMOVE(&table, present[k], KEYLEN); \
+			INSERT(&table, present[k], KEYLEN, present[k]); \
+		} \
+	} \
+	tmix = now() - t0; \
+	\
+	printf("%-8s %8u %8.1f %8.1f %8.1f %8.1f\n", #NAME, table.size, \
+		tins * 1e9 / count, thit * 1e9 / count, \
+		tmiss * 1e9 / count, tmix * 1e9 / count); \
+	FREE(&table); \
+}
+
+BENCH(linear, Hashtable, hashinit(&table, 0, 0, 0, NULL),
+	hashfind, hashinsert, hashremove, hashfree)
+BENCH(linear2, Hashtable, hashinit(&table, 0, 0, HASHPOW2, NULL),
+	hashfind, hashinsert, hashremove, hashfree)
+BENCH(robin, Rhtable, rhinit(&table, 0, 0, NULL),
+	rhfind, rhinsert, rhremove, rhfree)
+BENCH(swiss, Swtable, swinit(&table, 0, NULL),
+	swfind, swinsert, swremove, swfree)
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1)
+		count = atoi(argv[1]);
+
+	makekeys();
+
+	printf("%d keys, ns per operation\n", count);
+	printf("%-8s %8s %8s %8s %8s %8s\n",
+		"table", "size", "insert", "hit", "miss", "mixed");
+
+	bench_linear();
+	bench_linear2();
+	bench_robin();
+	bench_swiss();
+
+	return 0;
+}
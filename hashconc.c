@@ -0,0 +1,497 @@
+/* Concurrent hash table for read-mostly workloads.
+ *
+ * Linear probe tables, one per shard, with a mutex per
+ * shard for writers and no locking at all for readers.
+ *
+ * A slot is claimed by publishing a pointer to a copy of
+ * its key, and after that the slot keeps the same key for
+ * as long as the array lives. Only the value changes, and
+ * removing an entry leaves the key behind with a NULL
+ * value, so a reader can never see a slot half way through
+ * being rewritten. (This is why the backward-shift removal
+ * of hashtable.c is not used here.)
+ *
+ * When a shard fills up with entries and tombstones, it
+ * gets a new array and later writers each move a batch of
+ * slots from the old array to the new one. Readers look in
+ * the old array first and follow moved slots into the new.
+ * Before a writer changes a key, it moves that key's slot
+ * out of the old array, so whatever a reader finds in the
+ * old array is current.
+ *
+ * With -DTEST this is a benchmark of readers against one writer.
+ * hashtable.c has a test main of its own, so build it without:
+ *
+ *	cc -O2 -c hashtable.c
+ *	cc -O2 -DTEST -o hashconc hashconc.c hashtable.o -lpthread
+ *	./hashconc [threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "hashconc.h"
+
+enum {
+	SHARDBITS = 6,
+	NSHARDS = 1 << SHARDBITS,
+	MINSIZE = 16,
+	MIGRATE = 64, /* old slots moved per write */
+};
+
+typedef struct Cckey Cckey;
+typedef struct Ccslot Ccslot;
+typedef struct Ccarray Ccarray;
+
+struct Cckey
+{
+	int len;
+	char data[1];
+};
+
+struct Ccslot
+{
+	_Atomic(Cckey *) key;
+	unsigned hash;
+	_Atomic(void *) val;
+};
+
+struct Ccarray
+{
+	unsigned size;
+	unsigned used; /* slots with a key, live or removed */
+	int shift;
+	Ccarray *next; /* in the retired list */
+	Ccslot slots[1];
+};
+
+struct Ccshard
+{
+	_Alignas(64) pthread_mutex_t lock;
+	_Atomic(Ccarray *) cur;
+	_Atomic(Ccarray *) old; /* being moved into cur, or NULL */
+	unsigned moved; /* slots of old moved so far */
+	unsigned live;
+	Ccarray *retired;
+};
+
+/* Values of slots in an old array that has moved on. The key of a GONE slot
+ * was removed and is still owned by the old array. */
+static char moved_, gone_;
+#define MOVED ((void *)&moved_)
+#define GONE ((void *)&gone_)
+
+static Ccarray *ccalloc(unsigned want)
+{
+	Ccarray *a;
+	unsigned size;
+	int shift = 28;
+
+	for (size = MINSIZE; size < want && size < 0x80000000u; size <<= 1)
+		shift --;
+
+	a = calloc(1, sizeof(Ccarray) + (size - 1) * sizeof(Ccslot));
+	a->size = size;
+	a->shift = shift;
+	return a;
+}
+
+static unsigned ccslot(Ccarray *a, unsigned h)
+{
+	return (h * 2654435769u) >> a->shift;
+}
+
+/*
+ * Find the slot holding key, or NULL if an empty slot is reached first.
+ */
+static Ccslot *ccprobe(Ccarray *a, unsigned h, const void *key, int len)
+{
+	unsigned mask = a->size - 1;
+	unsigned pos = ccslot(a, h);
+	Ccslot *slot;
+	Cckey *k;
+
+	while (1)
+	{
+		slot = &a->slots[pos];
+		k = atomic_load_explicit(&slot->key, memory_order_acquire);
+		if (!k)
+			return NULL;
+		if (slot->hash == h && k->len == len && memcmp(k->data, key, len) == 0)
+			return slot;
+		pos = (pos + 1) & mask;
+	}
+}
+
+/*
+ * Claim an empty slot for a key that is not in the array.
+ */
+static void ccplace(Ccarray *a, unsigned h, Cckey *k, void *val)
+{
+	unsigned mask = a->size - 1;
+	unsigned pos = ccslot(a, h);
+
+	while (atomic_load_explicit(&a->slots[pos].key, memory_order_relaxed))
+		pos = (pos + 1) & mask;
+
+	a->slots[pos].hash = h;
+	atomic_store_explicit(&a->slots[pos].val, val, memory_order_relaxed);
+	atomic_store_explicit(&a->slots[pos].key, k, memory_order_release);
+	a->used ++;
+}
+
+/*
+ * Move one slot of the old array into the current one.
+ */
+static void ccmove(Ccshard *s, Ccslot *slot)
+{
+	Ccarray *cur = atomic_load_explicit(&s->cur, memory_order_relaxed);
+	Cckey *k = atomic_load_explicit(&slot->key, memory_order_relaxed);
+	void *val = atomic_load_explicit(&slot->val, memory_order_relaxed);
+
+	if (!k || val == MOVED || val == GONE)
+		return;
+
+	if (val)
+	{
+		ccplace(cur, slot->hash, k, val);
+		atomic_store_explicit(&slot->val, MOVED, memory_order_release);
+	}
+	else
+	{
+		atomic_store_explicit(&slot->val, GONE, memory_order_release);
+	}
+}
+
+static void ccmigrate(Ccshard *s, unsigned n)
+{
+	Ccarray *old = atomic_load_explicit(&s->old, memory_order_relaxed);
+
+	if (!old)
+		return;
+
+	while (n-- > 0 && s->moved < old->size)
+		ccmove(s, &old->slots[s->moved++]);
+
+	if (s->moved == old->size)
+	{
+		atomic_store_explicit(&s->old, NULL, memory_order_release);
+		old->next = s->retired;
+		s->retired = old;
+	}
+}
+
+static void ccgrow(Ccshard *s)
+{
+	Ccarray *cur = atomic_load_explicit(&s->cur, memory_order_relaxed);
+
+	/* finish the last move before starting another */
+	ccmigrate(s, ~0u);
+
+	/* publish old before cur, so a reader that sees the new array also sees the old */
+	s->moved = 0;
+	atomic_store_explicit(&s->old, cur, memory_order_release);
+	atomic_store_explicit(&s->cur, ccalloc((s->live + 1) * 4), memory_order_release);
+
+	ccmigrate(s, MIGRATE);
+}
+
+static Ccshard *ccshard(Cctable *table, unsigned h)
+{
+	return &table->shards[h >> (32 - SHARDBITS)];
+}
+
+/*
+ * With the shard locked, look up key in the current array after moving it
+ * out of the old array if it is there.
+ */
+static Ccslot *cclookup(Ccshard *s, unsigned h, const void *key, int len)
+{
+	Ccarray *old = atomic_load_explicit(&s->old, memory_order_relaxed);
+	Ccslot *slot;
+
+	ccmigrate(s, MIGRATE);
+
+	if (old)
+	{
+		slot = ccprobe(old, h, key, len);
+		if (slot)
+			ccmove(s, slot);
+	}
+
+	return ccprobe(atomic_load_explicit(&s->cur, memory_order_relaxed), h, key, len);
+}
+
+void ccinit(Cctable *table, unsigned size, Hashfunc hash)
+{
+	int i;
+
+	table->hash = hash ? hash : hashstring;
+	table->shards = aligned_alloc(64, NSHARDS * sizeof(Ccshard));
+
+	for (i = 0; i < NSHARDS; i++)
+	{
+		Ccshard *s = &table->shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		atomic_init(&s->cur, ccalloc(size / NSHARDS * 2));
+		atomic_init(&s->old, NULL);
+		s->moved = 0;
+		s->live = 0;
+		s->retired = NULL;
+	}
+}
+
+static void ccfreearray(Ccarray *a, int all)
+{
+	unsigned i;
+	void *val;
+
+	for (i = 0; i < a->size; i++)
+	{
+		val = atomic_load_explicit(&a->slots[i].val, memory_order_relaxed);
+		if (all || val == GONE)
+			free(atomic_load_explicit(&a->slots[i].key, memory_order_relaxed));
+	}
+
+	free(a);
+}
+
+void ccreclaim(Cctable *table)
+{
+	Ccarray *a;
+	int i;
+
+	for (i = 0; i < NSHARDS; i++)
+	{
+		Ccshard *s = &table->shards[i];
+		pthread_mutex_lock(&s->lock);
+		while ((a = s->retired) != NULL)
+		{
+			s->retired = a->next;
+			ccfreearray(a, 0);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void ccfree(Cctable *table)
+{
+	int i;
+
+	for (i = 0; i < NSHARDS; i++)
+		ccmigrate(&table->shards[i], ~0u);
+
+	ccreclaim(table);
+
+	for (i = 0; i < NSHARDS; i++)
+	{
+		Ccshard *s = &table->shards[i];
+		ccfreearray(atomic_load_explicit(&s->cur, memory_order_relaxed), 1);
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	free(table->shards);
+	table->shards = NULL;
+}
+
+void *ccfind(Cctable *table, const void *key, int len)
+{
+	unsigned h = table->hash(key, len);
+	Ccshard *s = ccshard(table, h);
+	Ccarray *cur, *old;
+	Ccslot *slot;
+	void *val;
+
+	while (1)
+	{
+		cur = atomic_load_explicit(&s->cur, memory_order_acquire);
+		old = atomic_load_explicit(&s->old, memory_order_acquire);
+
+		if (old && old != cur)
+		{
+			slot = ccprobe(old, h, key, len);
+			if (slot)
+			{
+				val = atomic_load_explicit(&slot->val, memory_order_acquire);
+				if (val != MOVED && val != GONE)
+					return val;
+			}
+		}
+
+		slot = ccprobe(cur, h, key, len);
+		if (!slot)
+			return NULL;
+
+		val = atomic_load_explicit(&slot->val, memory_order_acquire);
+		if (val != MOVED && val != GONE)
+			return val;
+
+		/* cur has itself been replaced since we loaded it */
+	}
+}
+
+void ccinsert(Cctable *table, const void *key, int len, void *val)
+{
+	unsigned h = table->hash(key, len);
+	Ccshard *s = ccshard(table, h);
+	Ccarray *cur;
+	Ccslot *slot;
+	Cckey *k;
+
+	pthread_mutex_lock(&s->lock);
+
+	slot = cclookup(s, h, key, len);
+	if (slot)
+	{
+		/* bring back a removed key; existing entries are left alone */
+		if (!atomic_load_explicit(&slot->val, memory_order_relaxed))
+		{
+			atomic_store_explicit(&slot->val, val, memory_order_release);
+			s->live ++;
+		}
+	}
+	else
+	{
+		cur = atomic_load_explicit(&s->cur, memory_order_relaxed);
+		if (cur->used + 1 > cur->size / 4 * 3)
+		{
+			ccgrow(s);
+			cur = atomic_load_explicit(&s->cur, memory_order_relaxed);
+		}
+
+		k = malloc(sizeof(Cckey) + len);
+		k->len = len;
+		memcpy(k->data, key, len);
+		ccplace(cur, h, k, val);
+		s->live ++;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+void ccremove(Cctable *table, const void *key, int len)
+{
+	unsigned h = table->hash(key, len);
+	Ccshard *s = ccshard(table, h);
+	Ccslot *slot;
+
+	pthread_mutex_lock(&s->lock);
+
+	slot = cclookup(s, h, key, len);
+	if (slot && atomic_load_explicit(&slot->val, memory_order_relaxed))
+	{
+		atomic_store_explicit(&slot->val, NULL, memory_order_release);
+		s->live --;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+#ifdef TEST
+
+#include <time.h>
+
+enum { NKEYS = 1 << 20, NREADS = 1 << 23 };
+
+static Cctable gtable;
+static char keys[NKEYS][8];
+static atomic_int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg)
+{
+	unsigned seed = (unsigned)(size_t)arg;
+	long bad = 0;
+	int i, k;
+	void *val;
+
+	for (i = 0; i < NREADS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		k = (seed >> 8) % NKEYS;
+		val = ccfind(&gtable, keys[k], 7);
+		/* even keys are never removed */
+		if (!(k & 1) && val != keys[k])
+			bad ++;
+	}
+
+	return (void *)bad;
+}
+
+static void *writer(void *arg)
+{
+	unsigned seed = 7;
+	int k;
+
+	(void)arg;
+
+	while (!atomic_load(&stop))
+	{
+		seed = seed * 1103515245 + 12345;
+		k = ((seed >> 8) % NKEYS) | 1;
+		ccremove(&gtable, keys[k], 7);
+		ccinsert(&gtable, keys[k], 7, keys[k]);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t tid[64], wid;
+	int maxthreads = argc > 1 ? atoi(argv[1]) : 8;
+	int i, n;
+	double t0, t;
+	void *bad;
+	long errors;
+
+	ccinit(&gtable, 0, NULL);
+
+	for (i = 0; i < NKEYS; i++)
+	{
+		sprintf(keys[i], "%07d", i);
+		ccinsert(&gtable, keys[i], 7, keys[i]);
+	}
+
+	printf("readers  Mreads/s  (with one writer churning odd keys)\n");
+
+	for (n = 1; n <= maxthreads && n <= 64; n *= 2)
+	{
+		atomic_store(&stop, 0);
+		pthread_create(&wid, NULL, writer, NULL);
+
+		t0 = now();
+		for (i = 0; i < n; i++)
+			pthread_create(&tid[i], NULL, reader, (void *)(size_t)(i + 1));
+		errors = 0;
+		for (i = 0; i < n; i++)
+		{
+			pthread_join(tid[i], &bad);
+			errors += (long)bad;
+		}
+		t = now() - t0;
+
+		atomic_store(&stop, 1);
+		pthread_join(wid, NULL);
+		ccreclaim(&gtable);
+
+		printf("%7d  %8.1f%s\n", n, (double)n * NREADS / t / 1e6,
+			errors ? "  LOST KEYS" : "");
+	}
+
+	ccfree(&gtable);
+
+	return 0;
+}
+
+#endif
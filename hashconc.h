@@ -0,0 +1,36 @@
+#ifndef hashconc_h
+#define hashconc_h
+
+#include "hashtable.h"
+
+typedef struct Cctable Cctable;
+typedef struct Ccshard Ccshard;
+
+/*
+ * The table is split into shards by the top bits of the hash. Readers never
+ * lock. Writers lock only the shard of their key, and a shard that has to
+ * grow moves its entries into the new array a few at a time on later writes.
+ *
+ * Keys are copied. Values may not be NULL.
+ */
+struct Cctable
+{
+	Hashfunc hash;
+	Ccshard *shards;
+};
+
+void ccinit(Cctable *table, unsigned size, Hashfunc hash);
+void ccfree(Cctable *table);
+
+void *ccfind(Cctable *table, const void *key, int len);
+void ccinsert(Cctable *table, const void *key, int len, void *val);
+void ccremove(Cctable *table, const void *key, int len);
+
+/*
+ * Arrays replaced by a resize may still have readers, so they are kept until
+ * ccreclaim is called at a point where no thread is inside ccfind, or until
+ * ccfree.
+ */
+void ccreclaim(Cctable *table);
+
+#endif
@@ -0,0 +1,539 @@
+/* Persistent hash tables.
+ *
+ * hashsave writes the entries of a Hashtable into a file that
+ * holds only offsets, never pointers, so it can be mapped at
+ * any address, shared between processes, and searched in place.
+ * The only work at start up is checking that every slot points
+ * inside the file, so a truncated or damaged file is refused
+ * rather than read past its end. A new file is written beside
+ * the old one and renamed over it, so processes that still map
+ * the old one keep reading it.
+ *
+ * The file has a header, one displacement per bucket if it uses
+ * a perfect hash, the slots, and then the key and value bytes.
+ * Numbers are in host byte order; a file written on a machine
+ * with the other byte order fails the magic number check.
+ *
+ * Plain files use linear probing over a power of two table that
+ * is at most half full. Minimal perfect hash files have exactly
+ * one slot per key, placed by hash and displace: keys are split
+ * into buckets of about four, and each bucket gets the first
+ * displacement that sends all of its keys to free slots. Then a
+ * lookup reads one displacement, one slot, and compares one key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashfile.h"
+
+enum { MAGIC = 0x48544142, VERSION = 1, MAXDISP = 1 << 20 };
+
+struct header
+{
+	unsigned magic;
+	unsigned version;
+	unsigned flags;
+	unsigned count; /* entries */
+	unsigned size; /* slots */
+	unsigned nbuckets; /* displacements */
+	unsigned length; /* of the whole file */
+	unsigned pad;
+};
+
+/* offsets are from the start of the file; key is 0 in an empty slot */
+struct slot
+{
+	unsigned hash;
+	unsigned key, keylen;
+	unsigned val, vallen;
+};
+
+struct Hashmap
+{
+	unsigned char *base;
+	size_t length;
+	struct header *head;
+	unsigned *disp;
+	struct slot *slots;
+	int shift;
+};
+
+/* A second hash, so that keys whose FNV hashes collide can still be told apart. */
+static unsigned hashother(const void *key, int len)
+{
+	const unsigned char *s = key;
+	const unsigned char *e = s + len;
+	unsigned h = 0;
+	while (s < e)
+		h = *s++ + (h << 6) + (h << 16) - h;
+	return h;
+}
+
+static unsigned mix(unsigned x)
+{
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+static unsigned mphslot(unsigned h1, unsigned h2, unsigned d, unsigned n)
+{
+	return mix(h1 ^ mix(h2 + d * 0x9e3779b9u)) % n;
+}
+
+/*
+ * Find a displacement for every bucket. Return -1 if some bucket has none,
+ * which in practice means two keys have the same pair of hashes.
+ */
+static int mphbuild(Hashentry **ents, unsigned *h1, unsigned n,
+	unsigned nbuckets, unsigned *disp, unsigned *where)
+{
+	unsigned *h2 = malloc(n * sizeof(unsigned));
+	unsigned *start = calloc(nbuckets + 1, sizeof(unsigned));
+	unsigned *member = malloc(n * sizeof(unsigned));
+	unsigned *order = malloc(nbuckets * sizeof(unsigned));
+	unsigned *bysize;
+	unsigned char *taken = calloc(n, 1);
+	unsigned i, j, k, b, d, s, maxsize = 0;
+	int code = 0;
+
+	/* group the keys by bucket */
+	for (i = 0; i < n; i++)
+	{
+		h2[i] = hashother(ents[i]->key, ents[i]->len);
+		start[h1[i] % nbuckets + 1] ++;
+	}
+	for (b = 0; b < nbuckets; b++)
+	{
+		if (maxsize < start[b + 1])
+			maxsize = start[b + 1];
+		start[b + 1] += start[b];
+	}
+	for (i = 0; i < n; i++)
+	{
+		b = h1[i] % nbuckets;
+		member[start[b] ++] = i;
+	}
+	for (b = nbuckets; b > 0; b--)
+		start[b] = start[b - 1];
+	start[0] = 0;
+
+	/* place the biggest buckets first, while there is most room */
+	bysize = calloc(maxsize + 2, sizeof(unsigned));
+	for (b = 0; b < nbuckets; b++)
+		bysize[maxsize - (start[b + 1] - start[b]) + 1] ++;
+	for (k = 0; k <= maxsize; k++)
+		bysize[k + 1] += bysize[k];
+	for (b = 0; b < nbuckets; b++)
+		order[bysize[maxsize - (start[b + 1] - start[b])] ++] = b;
+
+	for (k = 0; k < nbuckets; k++)
+	{
+		b = order[k];
+		disp[b] = 0;
+		if (start[b] == start[b + 1])
+			continue;
+
+		for (d = 0; d < MAXDISP; d++)
+		{
+			for (j = start[b]; j < start[b + 1]; j++)
+			{
+				i = member[j];
+				s = mphslot(h1[i], h2[i], d, n);
+				if (taken[s])
+					break;
+				taken[s] = 1;
+				where[i] = s;
+			}
+			if (j == start[b + 1])
+				break;
+			/* undo the partial placement */
+			while (j-- > start[b])
+				taken[where[member[j]]] = 0;
+		}
+
+		if (d == MAXDISP)
+		{
+			code = -1;
+			break;
+		}
+		disp[b] = d;
+	}
+
+	free(h2);
+	free(start);
+	free(member);
+	free(order);
+	free(bysize);
+	free(taken);
+	return code;
+}
+
+/*
+ * Write the image next to the file and rename it into place, so a reader
+ * that has the old file mapped keeps its pages instead of seeing it cut.
+ */
+static int writefile(const char *filename, unsigned char *image, size_t total)
+{
+	char *tmp;
+	FILE *f;
+	int code;
+
+	tmp = malloc(strlen(filename) + 5);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", filename);
+
+	code = -1;
+	f = fopen(tmp, "wb");
+	if (f)
+	{
+		if (fwrite(image, 1, total, f) == total && fflush(f) == 0 && fsync(fileno(f)) == 0)
+			code = 0;
+		if (fclose(f))
+			code = -1;
+		if (code == 0 && rename(tmp, filename) < 0)
+			code = -1;
+		if (code < 0)
+			remove(tmp);
+	}
+
+	free(tmp);
+	return code;
+}
+
+int hashsave(Hashtable *table, const char *filename, int (*valsize)(void *val), int flags)
+{
+	Hashentry **ents;
+	struct header *head;
+	struct slot *slots;
+	unsigned *h1, *disp, *where;
+	unsigned char *image;
+	unsigned n, i, pos, size, nbuckets, shift, len, ofs;
+	unsigned long long total;
+	int code;
+
+	ents = malloc((table->load + 1) * sizeof(Hashentry *));
+	for (i = n = 0; i < table->size; i++)
+		if (table->ents[i].val)
+			ents[n++] = &table->ents[i];
+
+	/* files always use hashstring, whatever hash the table used */
+	h1 = malloc((n + 1) * sizeof(unsigned));
+	for (i = 0; i < n; i++)
+		h1[i] = hashstring(ents[i]->key, ents[i]->len);
+
+	where = malloc((n + 1) * sizeof(unsigned));
+	disp = NULL;
+	nbuckets = 0;
+	shift = 0;
+
+	if (flags & HASHMPH)
+	{
+		size = n ? n : 1;
+		nbuckets = n / 4 + 1;
+		disp = malloc(nbuckets * sizeof(unsigned));
+		if (mphbuild(ents, h1, n, nbuckets, disp, where) < 0)
+		{
+			free(disp);
+			disp = NULL;
+			nbuckets = 0;
+			flags &= ~HASHMPH;
+		}
+	}
+
+	if (!(flags & HASHMPH))
+	{
+		shift = 28;
+		for (size = 16; size < n * 2; size <<= 1)
+			shift --;
+		/* home slots; collisions are resolved as the slots are filled */
+		for (i = 0; i < n; i++)
+			where[i] = (h1[i] * 2654435769u) >> shift;
+	}
+
+	total = sizeof(struct header) + nbuckets * sizeof(unsigned) + size * sizeof(struct slot);
+	for (i = 0; i < n; i++)
+	{
+		total += ents[i]->len;
+		total = (total + 7) & ~7ull;
+		total += valsize ? valsize(ents[i]->val) : strlen(ents[i]->val) + 1;
+	}
+	if (total > 0xffffffffull)
+	{
+		free(ents);
+		free(h1);
+		free(where);
+		free(disp);
+		return -1;
+	}
+
+	image = calloc(1, total);
+	head = (struct header *)image;
+	head->magic = MAGIC;
+	head->version = VERSION;
+	head->flags = flags & HASHMPH;
+	head->count = n;
+	head->size = size;
+	head->nbuckets = nbuckets;
+	head->length = total;
+	if (nbuckets)
+		memcpy(image + sizeof(struct header), disp, nbuckets * sizeof(unsigned));
+	slots = (struct slot *)(image + sizeof(struct header) + nbuckets * sizeof(unsigned));
+
+	ofs = sizeof(struct header) + nbuckets * sizeof(unsigned) + size * sizeof(struct slot);
+	for (i = 0; i < n; i++)
+	{
+		pos = where[i];
+		if (!(flags & HASHMPH))
+			while (slots[pos].key)
+				pos = (pos + 1) & (size - 1);
+
+		slots[pos].hash = h1[i];
+		slots[pos].key = ofs;
+		slots[pos].keylen = ents[i]->len;
+		memcpy(image + ofs, ents[i]->key, ents[i]->len);
+		ofs = (ofs + ents[i]->len + 7) & ~7u;
+
+		len = valsize ? valsize(ents[i]->val) : strlen(ents[i]->val) + 1;
+		slots[pos].val = ofs;
+		slots[pos].vallen = len;
+		memcpy(image + ofs, ents[i]->val, len);
+		ofs += len;
+	}
+
+	code = writefile(filename, image, total);
+
+	free(image);
+	free(ents);
+	free(h1);
+	free(where);
+	free(disp);
+	return code;
+}
+
+/*
+ * Every key and value must lie after the slots and within the file,
+ * and a probed table needs an empty slot to stop at.
+ */
+static int slotsvalid(struct header *head, struct slot *slots, unsigned long long data)
+{
+	unsigned long long length = head->length;
+	unsigned i, used = 0;
+
+	for (i = 0; i < head->size; i++)
+	{
+		if (!slots[i].key)
+			continue;
+		if (slots[i].key < data || slots[i].key + (unsigned long long)slots[i].keylen > length ||
+			slots[i].val < data || slots[i].val + (unsigned long long)slots[i].vallen > length)
+			return 0;
+		used ++;
+	}
+	if (used != head->count)
+		return 0;
+	return (head->flags & HASHMPH) || used < head->size;
+}
+
+Hashmap *hashmapopen(const char *filename)
+{
+	Hashmap *map;
+	struct header *head;
+	struct stat st;
+	void *base;
+	unsigned long long need;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct header))
+	{
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	head = base;
+	need = sizeof(struct header) +
+		(unsigned long long)head->nbuckets * sizeof(unsigned) +
+		(unsigned long long)head->size * sizeof(struct slot);
+	if (head->magic != MAGIC || head->version != VERSION ||
+		head->length != st.st_size || need > st.st_size || head->size == 0 ||
+		((head->flags & HASHMPH) ? head->nbuckets == 0 :
+			(head->size & (head->size - 1)) != 0) ||
+		!slotsvalid(head, (struct slot *)((unsigned char *)base + sizeof(struct header) +
+			head->nbuckets * sizeof(unsigned)), need))
+	{
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	map = malloc(sizeof(Hashmap));
+	map->base = base;
+	map->length = st.st_size;
+	map->head = head;
+	map->disp = (unsigned *)(map->base + sizeof(struct header));
+	map->slots = (struct slot *)(map->disp + head->nbuckets);
+	map->shift = 32;
+	while ((1u << (32 - map->shift)) < head->size)
+		map->shift --;
+	return map;
+}
+
+void hashmapclose(Hashmap *map)
+{
+	if (map)
+	{
+		munmap(map->base, map->length);
+		free(map);
+	}
+}
+
+const void *hashmapfind(Hashmap *map, const void *key, int len, int *vallen)
+{
+	struct header *head = map->head;
+	unsigned h = hashstring(key, len);
+	struct slot *slot;
+	unsigned pos;
+
+	if (head->flags & HASHMPH)
+	{
+		pos = mphslot(h, hashother(key, len), map->disp[h % head->nbuckets], head->size);
+		slot = &map->slots[pos];
+		if (!slot->key || slot->hash != h || slot->keylen != len ||
+			memcmp(map->base + slot->key, key, len))
+			return NULL;
+	}
+	else
+	{
+		pos = (h * 2654435769u) >> map->shift;
+		while (1)
+		{
+			slot = &map->slots[pos];
+			if (!slot->key)
+				return NULL;
+			if (slot->hash == h && slot->keylen == len &&
+				memcmp(map->base + slot->key, key, len) == 0)
+				break;
+			pos = (pos + 1) & (head->size - 1);
+		}
+	}
+
+	if (vallen)
+		*vallen = slot->vallen;
+	return map->base + slot->val;
+}
+
+#ifdef TEST
+
+static int intsize(void *val)
+{
+	return sizeof(int);
+}
+
+int
+main(int argc, char **argv)
+{
+	static char names[0x10000][8];
+	static int codes[0x10000];
+	Hashtable table;
+	Hashmap *map;
+	const int *val;
+	char miss[8];
+	int i, flags, len, bad;
+
+	hashinit(&table, 0x10000, 0, 0, NULL);
+	for (i = 0; i < 0x10000; i++)
+	{
+		sprintf(names[i], "uni%04X", i);
+		codes[i] = i;
+		hashinsert(&table, names[i], 7, &codes[i]);
+	}
+
+	for (flags = 0; flags <= HASHMPH; flags++)
+	{
+		if (hashsave(&table, "hashfile.tab", intsize, flags) < 0)
+		{
+			printf("cannot save table\n");
+			return 1;
+		}
+
+		map = hashmapopen("hashfile.tab");
+		if (!map)
+		{
+			printf("cannot map table\n");
+			return 1;
+		}
+
+		bad = 0;
+		for (i = 0; i < 0x10000; i++)
+		{
+			val = hashmapfind(map, names[i], 7, &len);
+			if (!val || len != sizeof(int) || *val != i)
+				bad ++;
+			sprintf(miss, "uni%04x", i);
+			if (hashmapfind(map, miss, 7, NULL) && strcmp(miss, names[i]))
+				bad ++;
+		}
+
+		printf("%s: %d slots, %u bytes, %d bad\n",
+			map->head->flags & HASHMPH ? "perfect" : "linear",
+			map->head->size, map->head->length, bad);
+
+		hashmapclose(map);
+	}
+
+	/* saving again must not pull the file from under a mapping */
+	map = hashmapopen("hashfile.tab");
+	if (map && hashsave(&table, "hashfile.tab", intsize, 0) == 0)
+	{
+		bad = 0;
+		for (i = 0; i < 0x10000; i++)
+		{
+			val = hashmapfind(map, names[i], 7, &len);
+			if (!val || *val != i)
+				bad ++;
+		}
+		printf("replaced while mapped: %d bad\n", bad);
+	}
+	hashmapclose(map);
+
+	/* a slot pointing past the end must be refused */
+	if (hashsave(&table, "hashfile.tab", intsize, 0) == 0)
+	{
+		struct header head;
+		struct slot slot;
+		FILE *f = fopen("hashfile.tab", "r+b");
+		fread(&head, sizeof head, 1, f);
+		do
+			fread(&slot, sizeof slot, 1, f);
+		while (!slot.key);
+		slot.val = head.length - 2;
+		fseek(f, -(long)sizeof slot, SEEK_CUR);
+		fwrite(&slot, sizeof slot, 1, f);
+		fclose(f);
+		map = hashmapopen("hashfile.tab");
+		printf("damaged: %s\n", map ? "mapped" : "refused");
+		hashmapclose(map);
+	}
+
+	remove("hashfile.tab");
+	hashfree(&table);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef hashfile_h
+#define hashfile_h
+
+#include "hashtable.h"
+
+typedef struct Hashmap Hashmap;
+
+enum { HASHMPH = 1 };
+
+/*
+ * hashsave: Write the table to a file that hashmapopen can map. Each value
+ * is stored as valsize(val) bytes, or as a NUL terminated string if valsize
+ * is NULL. With HASHMPH the file uses a minimal perfect hash instead of
+ * open addressing. Return 0 on success and -1 on error.
+ */
+int hashsave(Hashtable *table, const char *filename, int (*valsize)(void *val), int flags);
+
+/* hashmapopen: Map a table written by hashsave. NULL if it cannot be read. */
+Hashmap *hashmapopen(const char *filename);
+void hashmapclose(Hashmap *map);
+
+/* hashmapfind: Return a pointer to the stored value inside the mapping, or NULL. */
+const void *hashmapfind(Hashmap *map, const void *key, int len, int *vallen);
+
+#endif
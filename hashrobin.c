@@ -0,0 +1,371 @@
+/* Robin Hood hash table.
+ *
+ * Linear probing where an insert takes over the slot of any
+ * entry that is closer to its home slot than the new one would
+ * be. This keeps probe lengths short and even at high loads,
+ * and a lookup can stop as soon as it meets an entry that is
+ * closer to home than the key it is looking for.
+ *
+ * Each slot has a metadata word with the probe distance and
+ * a fragment of the hash, kept in an array of its own. Most
+ * mismatches are rejected there without touching the keys.
+ *
+ * Removal shifts the following entries back one slot until
+ * one is at its home slot, so there are no tombstones.
+ *
+ * Probe distances stop at 255. An entry that would go further
+ * grows the table, unless it is already four times the size
+ * its load needs, since then the keys most likely share one
+ * hash and growing would not separate them. Such entries go
+ * to an overflow list that is searched after the table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashrobin.h"
+
+enum { MAXDIST = 255 };
+
+#define DIST(m) ((m) & 0xff)
+#define FRAG(h) ((h) & ~0xffu)
+
+static void rhplace(Rhtable *table, unsigned h, Rhentry ent);
+
+static unsigned rhslot(Rhtable *table, unsigned h)
+{
+	return (h * 2654435769u) >> table->shift;
+}
+
+static void nomem(void)
+{
+	fprintf(stderr, "hashrobin: out of memory\n");
+	abort();
+}
+
+static void rhalloc(Rhtable *table, unsigned want)
+{
+	unsigned size;
+
+	table->shift = 27;
+	for (size = 32; size < want && size < 0x80000000u; size <<= 1)
+		table->shift --;
+
+	table->size = size;
+	table->maxload = (unsigned long long)size * table->loadfactor / 100;
+	if (table->maxload >= size)
+		table->maxload = size - 1;
+	table->meta = calloc(size, sizeof(unsigned));
+	table->ents = malloc((size_t)size * sizeof(Rhentry));
+	if (!table->meta || !table->ents)
+		nomem();
+}
+
+static void rhresize(Rhtable *table, unsigned want)
+{
+	unsigned *meta = table->meta;
+	Rhentry *ents = table->ents;
+	unsigned size = table->size;
+	Rhentry *over = table->over;
+	unsigned nover = table->nover;
+	unsigned i;
+
+	rhalloc(table, want);
+	table->load = 0;
+	table->over = NULL;
+	table->nover = 0;
+	table->maxover = 0;
+
+	for (i = 0; i < size; i++)
+		if (meta[i])
+			rhplace(table, table->hash(ents[i].key, ents[i].len), ents[i]);
+	for (i = 0; i < nover; i++)
+		rhplace(table, table->hash(over[i].key, over[i].len), over[i]);
+
+	free(meta);
+	free(ents);
+	free(over);
+}
+
+/*
+ * Grow only while the table is less than four times the size its load
+ * needs at the load factor. Past that, more room will not help.
+ */
+static int rhcangrow(Rhtable *table)
+{
+	return table->size < 0x80000000u &&
+		(unsigned long long)table->load * 400 / table->loadfactor > table->size;
+}
+
+static void rhspill(Rhtable *table, Rhentry ent)
+{
+	if (table->nover == table->maxover)
+	{
+		table->maxover = table->maxover ? table->maxover * 2 : 16;
+		table->over = realloc(table->over, table->maxover * sizeof(Rhentry));
+		if (!table->over)
+			nomem();
+	}
+	table->over[table->nover++] = ent;
+}
+
+/*
+ * Insert an entry that is known not to be in the table.
+ */
+static void rhplace(Rhtable *table, unsigned h, Rhentry ent)
+{
+	unsigned *meta = table->meta;
+	Rhentry *ents = table->ents;
+	unsigned mask = table->size - 1;
+	unsigned pos = rhslot(table, h);
+	unsigned m = FRAG(h) | 1;
+	unsigned tm;
+	Rhentry te;
+
+	table->load ++;
+
+	while (1)
+	{
+		if (!meta[pos])
+		{
+			meta[pos] = m;
+			ents[pos] = ent;
+			return;
+		}
+
+		if (DIST(meta[pos]) < DIST(m))
+		{
+			tm = meta[pos]; meta[pos] = m; m = tm;
+			te = ents[pos]; ents[pos] = ent; ent = te;
+		}
+
+		if (DIST(m) == MAXDIST)
+		{
+			/* the carried entry would go too far; grow and place it again */
+			if (!rhcangrow(table))
+			{
+				rhspill(table, ent);
+				return;
+			}
+			table->load --;
+			rhresize(table, table->size * 2);
+			rhplace(table, table->hash(ent.key, ent.len), ent);
+			return;
+		}
+
+		pos = (pos + 1) & mask;
+		m ++;
+	}
+}
+
+void rhinit(Rhtable *table, unsigned size, int loadfactor, Hashfunc hash)
+{
+	if (loadfactor <= 0 || loadfactor > 100)
+		loadfactor = 90;
+	table->load = 0;
+	table->loadfactor = loadfactor;
+	table->hash = hash ? hash : hashstring;
+	table->over = NULL;
+	table->nover = 0;
+	table->maxover = 0;
+	rhalloc(table, (unsigned long long)size * 100 / loadfactor + 1);
+}
+
+void rhfree(Rhtable *table)
+{
+	free(table->meta);
+	free(table->ents);
+	free(table->over);
+	table->meta = NULL;
+	table->ents = NULL;
+	table->over = NULL;
+	table->size = 0;
+	table->load = 0;
+	table->nover = 0;
+	table->maxover = 0;
+}
+
+/*
+ * Return the slot holding key, or -1.
+ */
+static int rhlookup(Rhtable *table, unsigned h, const void *key, int len)
+{
+	unsigned *meta = table->meta;
+	unsigned mask = table->size - 1;
+	unsigned pos = rhslot(table, h);
+	unsigned m = FRAG(h) | 1;
+
+	/* an entry with the same hash sits at the same distance */
+	while (DIST(meta[pos]) >= DIST(m))
+	{
+		if (meta[pos] == m && table->ents[pos].len == len &&
+			memcmp(key, table->ents[pos].key, len) == 0)
+			return pos;
+
+		if (DIST(m) == MAXDIST)
+			break;
+
+		pos = (pos + 1) & mask;
+		m ++;
+	}
+
+	return -1;
+}
+
+/*
+ * Return the index of key in the overflow list, or -1.
+ */
+static int rhlookover(Rhtable *table, const void *key, int len)
+{
+	unsigned i;
+
+	for (i = 0; i < table->nover; i++)
+		if (table->over[i].len == len &&
+			memcmp(key, table->over[i].key, len) == 0)
+			return i;
+
+	return -1;
+}
+
+void *rhfind(Rhtable *table, const void *key, int len)
+{
+	int pos = rhlookup(table, table->hash(key, len), key, len);
+	if (pos >= 0)
+		return table->ents[pos].val;
+	pos = rhlookover(table, key, len);
+	return pos < 0 ? NULL : table->over[pos].val;
+}
+
+void rhinsert(Rhtable *table, const void *key, int len, void *val)
+{
+	unsigned h = table->hash(key, len);
+	Rhentry ent;
+
+	if (rhlookup(table, h, key, len) >= 0 || rhlookover(table, key, len) >= 0)
+		return;
+
+	if (table->load >= table->maxload)
+		rhresize(table, table->size * 2);
+
+	ent.key = key;
+	ent.len = len;
+	ent.val = val;
+	rhplace(table, h, ent);
+}
+
+void rhremove(Rhtable *table, const void *key, int len)
+{
+	unsigned *meta = table->meta;
+	Rhentry *ents = table->ents;
+	unsigned mask = table->size - 1;
+	int pos = rhlookup(table, table->hash(key, len), key, len);
+	unsigned hole, look;
+
+	if (pos < 0)
+	{
+		pos = rhlookover(table, key, len);
+		if (pos >= 0)
+		{
+			table->over[pos] = table->over[--table->nover];
+			table->load --;
+		}
+		return;
+	}
+
+	/* shift back everything that is not at its home slot */
+	hole = pos;
+	look = (hole + 1) & mask;
+	while (DIST(meta[look]) > 1)
+	{
+		meta[hole] = meta[look] - 1;
+		ents[hole] = ents[look];
+		hole = look;
+		look = (look + 1) & mask;
+	}
+	meta[hole] = 0;
+
+	table->load --;
+}
+
+void rhdebug(Rhtable *table)
+{
+	int i;
+
+	printf("cache load %d / %d\n", table->load, table->size);
+	if (table->nover)
+		printf("overflow %d\n", table->nover);
+
+	for (i = 0; i < table->size; i++)
+		if (!table->meta[i])
+			printf("table % 4d: empty\n", i);
+		else
+			printf("table % 4d: dist=%-3d key=%-16.*s val=%s\n", i,
+					DIST(table->meta[i]) - 1,
+					table->ents[i].len, (char*)table->ents[i].key,
+					(char*)table->ents[i].val);
+}
+
+#ifdef TEST
+
+static unsigned samehash(const void *key, int len)
+{
+	return 0x12345678;
+}
+
+int
+main(int argc, char **argv)
+{
+	Rhtable gtable, *table = &gtable;
+	static char keys[1000000][8];
+	int i, n = 943000, hist[MAXDIST+1] = {0};
+	double sum = 0;
+
+	/* more keys with one hash than a probe may pass */
+	rhinit(table, 0, 90, samehash);
+	for (i = 0; i < 300; i++)
+	{
+		sprintf(keys[i], "%07d", i);
+		rhinsert(table, keys[i], 7, keys[i]);
+	}
+	printf("same hash: load %d / %d, overflow %d\n",
+		table->load, table->size, table->nover);
+	for (i = 0; i < 300; i += 2)
+		rhremove(table, keys[i], 7);
+	for (i = 0; i < 300; i++)
+		if ((rhfind(table, keys[i], 7) != NULL) != (i % 2 != 0))
+			printf("lost key %s\n", keys[i]);
+	rhfree(table);
+
+	rhinit(table, 0, 90, NULL);
+
+	for (i = 0; i < n; i++)
+	{
+		sprintf(keys[i], "%07d", i);
+		rhinsert(table, keys[i], 7, keys[i]);
+	}
+	for (i = 0; i < table->size; i++)
+		if (table->meta[i])
+		{
+			hist[DIST(table->meta[i]) - 1] ++;
+			sum += DIST(table->meta[i]) - 1;
+		}
+
+	printf("cache load %d / %d\n", table->load, table->size);
+	printf("mean probe distance %.2f\n", sum / table->load);
+	for (i = 0; i <= MAXDIST; i++)
+		if (hist[i])
+			printf("distance %3d: %d\n", i, hist[i]);
+
+	for (i = 0; i < n; i += 3)
+		rhremove(table, keys[i], 7);
+	for (i = 0; i < n; i++)
+		if ((rhfind(table, keys[i], 7) != NULL) != (i % 3 != 0))
+			printf("lost key %s\n", keys[i]);
+
+	rhfree(table);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef hashrobin_h
+#define hashrobin_h
+
+#include "hashtable.h"
+
+typedef struct Rhtable Rhtable;
+typedef struct Rhentry Rhentry;
+
+struct Rhentry
+{
+	const void *key;
+	int len;
+	void *val;
+};
+
+/*
+ * meta[i] holds the probe distance of slot i plus one in the low byte
+ * (zero for an empty slot) and a fragment of the key's hash above it.
+ * Entries that would pass 255 slots in a table already much larger than
+ * its load go to the unordered over array instead.
+ */
+struct Rhtable
+{
+	unsigned size;
+	unsigned load;
+	unsigned maxload;
+	int loadfactor;
+	int shift;
+	Hashfunc hash;
+	unsigned *meta;
+	Rhentry *ents;
+	Rhentry *over;
+	unsigned nover;
+	unsigned maxover;
+};
+
+/*
+ * Same as hashinit, but sizes are always powers of two and the default load
+ * factor is 90. The table also grows early if any probe would pass 255 slots,
+ * unless it is already four times the size its load needs; keys sharing one
+ * hash then spill into a list that lookups search after the table.
+ */
+void rhinit(Rhtable *table, unsigned size, int loadfactor, Hashfunc hash);
+void rhfree(Rhtable *table);
+
+void *rhfind(Rhtable *table, const void *key, int len);
+void rhinsert(Rhtable *table, const void *key, int len, void *val);
+void rhremove(Rhtable *table, const void *key, int len);
+
+void rhdebug(Rhtable *table);
+
+#endif
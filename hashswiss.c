@@ -0,0 +1,252 @@
+/* Group probing hash table, in the style of Swiss tables.
+ *
+ * Every slot has a control byte: empty, deleted, or seven
+ * bits of the hash of its key. Slots are probed in groups
+ * of sixteen, and one SSE2 compare finds all the slots in
+ * a group whose control byte matches, so keys are compared
+ * only for the few slots that are likely to hold them.
+ *
+ * Groups are visited in triangular order. A lookup stops at
+ * the first group with an empty slot; a removed entry only
+ * leaves a tombstone if its group has no empty slot, since
+ * only then can a probe for another key have passed it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashswiss.h"
+
+enum { GROUP = 16, EMPTY = 0x80, DELETED = 0xfe };
+
+static unsigned swmatch(const unsigned char *ctrl, int c)
+{
+#ifdef __SSE2__
+	__m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+	unsigned m = 0;
+	int i;
+	for (i = 0; i < GROUP; i++)
+		if (ctrl[i] == c)
+			m |= 1 << i;
+	return m;
+#endif
+}
+
+/* Empty and deleted slots are the ones with the top bit set. */
+static unsigned swavail(const unsigned char *ctrl)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+	unsigned m = 0;
+	int i;
+	for (i = 0; i < GROUP; i++)
+		if (ctrl[i] & 0x80)
+			m |= 1 << i;
+	return m;
+#endif
+}
+
+static int lowbit(unsigned m)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(m);
+#else
+	int i = 0;
+	while (!(m & 1))
+	{
+		m >>= 1;
+		i ++;
+	}
+	return i;
+#endif
+}
+
+static unsigned swgroup(Swtable *table, unsigned h)
+{
+	return (h * 2654435769u) >> table->shift;
+}
+
+static void swalloc(Swtable *table, unsigned want)
+{
+	unsigned size;
+
+	table->shift = 31;
+	for (size = 32; size < want && size < 0x80000000u; size <<= 1)
+		table->shift --;
+
+	table->size = size;
+	table->growth = size - size / 8;
+	table->ctrl = malloc(size);
+	memset(table->ctrl, EMPTY, size);
+	table->ents = malloc(size * sizeof(Swentry));
+}
+
+/*
+ * Return the first empty or deleted slot on the probe sequence for h.
+ */
+static unsigned swslot(Swtable *table, unsigned h)
+{
+	unsigned mask = table->size / GROUP - 1;
+	unsigned g = swgroup(table, h);
+	unsigned step = 0;
+	unsigned m;
+
+	while (1)
+	{
+		m = swavail(table->ctrl + g * GROUP);
+		if (m)
+			return g * GROUP + lowbit(m);
+		g = (g + ++step) & mask;
+	}
+}
+
+static void swresize(Swtable *table, unsigned want)
+{
+	unsigned char *ctrl = table->ctrl;
+	Swentry *ents = table->ents;
+	unsigned size = table->size;
+	unsigned i, h, pos;
+
+	swalloc(table, want);
+
+	for (i = 0; i < size; i++)
+	{
+		if (!(ctrl[i] & 0x80))
+		{
+			h = table->hash(ents[i].key, ents[i].len);
+			pos = swslot(table, h);
+			table->ctrl[pos] = h & 0x7f;
+			table->ents[pos] = ents[i];
+			table->growth --;
+		}
+	}
+
+	free(ctrl);
+	free(ents);
+}
+
+void swinit(Swtable *table, unsigned size, Hashfunc hash)
+{
+	table->load = 0;
+	table->hash = hash ? hash : hashstring;
+	swalloc(table, (unsigned long long)size * 8 / 7 + 1);
+}
+
+void swfree(Swtable *table)
+{
+	free(table->ctrl);
+	free(table->ents);
+	table->ctrl = NULL;
+	table->ents = NULL;
+	table->size = 0;
+	table->load = 0;
+}
+
+/*
+ * Return the slot holding key, or -1.
+ */
+static int swlookup(Swtable *table, unsigned h, const void *key, int len)
+{
+	unsigned mask = table->size / GROUP - 1;
+	unsigned g = swgroup(table, h);
+	unsigned step = 0;
+	unsigned m;
+	int i;
+
+	while (1)
+	{
+		const unsigned char *ctrl = table->ctrl + g * GROUP;
+
+		for (m = swmatch(ctrl, h & 0x7f); m; m &= m - 1)
+		{
+			i = g * GROUP + lowbit(m);
+			if (table->ents[i].len == len &&
+				memcmp(key, table->ents[i].key, len) == 0)
+				return i;
+		}
+
+		if (swmatch(ctrl, EMPTY))
+			return -1;
+
+		g = (g + ++step) & mask;
+	}
+}
+
+void *swfind(Swtable *table, const void *key, int len)
+{
+	int pos = swlookup(table, table->hash(key, len), key, len);
+	return pos < 0 ? NULL : table->ents[pos].val;
+}
+
+void swinsert(Swtable *table, const void *key, int len, void *val)
+{
+	unsigned h = table->hash(key, len);
+	unsigned pos;
+
+	if (swlookup(table, h, key, len) >= 0)
+		return;
+
+	if (table->growth == 0)
+	{
+		/* grow if really full, otherwise just sweep out the tombstones */
+		if (table->load >= table->size / 2)
+			swresize(table, table->size * 2);
+		else
+			swresize(table, table->size);
+	}
+
+	pos = swslot(table, h);
+	if (table->ctrl[pos] == EMPTY)
+		table->growth --;
+	table->ctrl[pos] = h & 0x7f;
+	table->ents[pos].key = key;
+	table->ents[pos].len = len;
+	table->ents[pos].val = val;
+	table->load ++;
+}
+
+void swremove(Swtable *table, const void *key, int len)
+{
+	int pos = swlookup(table, table->hash(key, len), key, len);
+
+	if (pos < 0)
+		return;
+
+	if (swmatch(table->ctrl + pos / GROUP * GROUP, EMPTY))
+	{
+		table->ctrl[pos] = EMPTY;
+		table->growth ++;
+	}
+	else
+	{
+		table->ctrl[pos] = DELETED;
+	}
+
+	table->load --;
+}
+
+void swdebug(Swtable *table)
+{
+	int i;
+
+	printf("cache load %d / %d\n", table->load, table->size);
+
+	for (i = 0; i < table->size; i++)
+		if (table->ctrl[i] == EMPTY)
+			printf("table % 4d: empty\n", i);
+		else if (table->ctrl[i] == DELETED)
+			printf("table % 4d: deleted\n", i);
+		else
+			printf("table % 4d: h7=%02x key=%-16.*s val=%s\n", i,
+					table->ctrl[i],
+					table->ents[i].len, (char*)table->ents[i].key,
+					(char*)table->ents[i].val);
+}
@@ -0,0 +1,41 @@
+#ifndef hashswiss_h
+#define hashswiss_h
+
+#include "hashtable.h"
+
+typedef struct Swtable Swtable;
+typedef struct Swentry Swentry;
+
+struct Swentry
+{
+	const void *key;
+	int len;
+	void *val;
+};
+
+/*
+ * ctrl[i] is EMPTY, DELETED, or the low 7 bits of the hash of the key
+ * in slot i. Slots are probed in aligned groups of 16.
+ */
+struct Swtable
+{
+	unsigned size;
+	unsigned load;
+	unsigned growth; /* inserts left before the table must be rehashed */
+	int shift;
+	Hashfunc hash;
+	unsigned char *ctrl;
+	Swentry *ents;
+};
+
+/* Same as hashinit, but the load factor is fixed at 7/8. */
+void swinit(Swtable *table, unsigned size, Hashfunc hash);
+void swfree(Swtable *table);
+
+void *swfind(Swtable *table, const void *key, int len);
+void swinsert(Swtable *table, const void *key, int len, void *val);
+void swremove(Swtable *table, const void *key, int len);
+
+void swdebug(Swtable *table);
+
+#endif
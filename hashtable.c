@@ -7,114 +7,234 @@
  * correctly in this implementation so it wont start
  * exhibiting bad behaviour if entries are inserted
  * and removed frequently.
- */ 
+ *
+ * The table grows by rehashing into a larger one when
+ * the load passes the load factor, so it never fills up,
+ * until it has MAXPOW2 slots, or the largest prime. Then
+ * it fills past the load factor, and inserting a new key
+ * into it when only one slot is left free aborts.
+ *
+ * Build with HASHSTATS to count lookups and probe lengths.
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hashtable.h"
+
 static const unsigned primes[] = {
 	31, 61, 127, 251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521,
-	131071, 262139, 524287, 1048573, 2097143, 4194301, 8388593, 0
+	131071, 262139, 524287, 1048573, 2097143, 4194301, 8388593, 16777213,
+	33554393, 67108859, 134217689, 268435399, 536870909, 1073741789, 0
 };
 
-// enum { KEYLEN = 16, SIZE = 509 };
-enum { KEYLEN = 4, SIZE = 8 };
+#define MAXPOW2 0x80000000u
+#define MAXPRIME (primes[sizeof primes / sizeof primes[0] - 2])
 
-typedef struct Hashtable Hashtable;
-typedef struct Hashentry Hashentry;
+#define NEXT(size, pos) \
+	((pos) + 1 == (size) ? 0 : (pos) + 1)
 
-struct Hashentry
-{
-	char key[KEYLEN];
-	void *val;
-};
+/* distance from the home slot to pos, going round the end */
+#define DISTANCE(size, home, pos) \
+	((pos) >= (home) ? (pos) - (home) : (size) - (home) + (pos))
 
-struct Hashtable
-{
-	unsigned size;
-	unsigned load;
-	Hashentry ents[SIZE];
-};
+#ifdef HASHSTATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
 
-#if 0
-static unsigned hash(char *s)
+/* FNV-1a */
+unsigned hashstring(const void *key, int len)
 {
-	char *e = s + KEYLEN;
-	unsigned h = 0;
+	const unsigned char *s = key;
+	const unsigned char *e = s + len;
+	unsigned h = 2166136261u;
 	while (s < e)
-		h = *s++ + (h << 6) + (h << 16) - h;
+		h = (h ^ *s++) * 16777619;
 	return h;
 }
-#else
-static unsigned hash(char *s)
+
+static unsigned hashslot(Hashtable *table, unsigned h)
 {
-	unsigned i = *(unsigned*)s;
-	return i % SIZE;
+	/* fibonacci hashing spreads weak hashes over power of two tables */
+	if (table->flags & HASHPOW2)
+		return (h * 2654435769u) >> table->shift;
+	return h % table->size;
+}
+
+#ifdef HASHSTATS
+static void hashcount(Hashtable *table, unsigned home, unsigned pos, int hit)
+{
+	Hashstats *st = &table->stats;
+	unsigned probe = DISTANCE(table->size, home, pos);
+
+	st->lookups ++;
+	if (hit)
+		st->hits ++;
+	else
+		st->misses ++;
+	st->probes += probe;
+	if (st->maxprobe < probe)
+		st->maxprobe = probe;
+	st->hist[probe < HASHHIST ? probe : HASHHIST - 1] ++;
 }
 #endif
 
-void hashinit(Hashtable *table)
+static void hashalloc(Hashtable *table, unsigned want)
 {
-	table->size = SIZE;
+	unsigned size;
+	int i;
+
+	if (table->flags & HASHPOW2)
+	{
+		table->shift = 27;
+		for (size = 32; size < want && size < MAXPOW2; size <<= 1)
+			table->shift --;
+	}
+	else
+	{
+		for (i = 0; primes[i+1] && primes[i] < want; i++)
+			;
+		size = primes[i];
+	}
+
+	table->size = size;
+	table->maxload = (unsigned long long)size * table->loadfactor / 100;
+	if (table->maxload >= size)
+		table->maxload = size - 1;
+	table->ents = calloc(size, sizeof(Hashentry));
+	if (!table->ents)
+	{
+		fprintf(stderr, "hashtable: out of memory for %u slots\n", size);
+		abort();
+	}
+}
+
+static void hashresize(Hashtable *table, unsigned want)
+{
+	Hashentry *old = table->ents;
+	unsigned oldsize = table->size;
+	unsigned i, pos;
+
+	STAT(table->stats.resizes ++);
+	hashalloc(table, want);
+
+	for (i = 0; i < oldsize; i++)
+	{
+		if (old[i].val)
+		{
+			pos = hashslot(table, old[i].hash);
+			while (table->ents[pos].val)
+				pos = NEXT(table->size, pos);
+			table->ents[pos] = old[i];
+		}
+	}
+
+	free(old);
+}
+
+void hashinit(Hashtable *table, unsigned size, int loadfactor, int flags, Hashfunc hash)
+{
+	if (loadfactor <= 0 || loadfactor > 100)
+		loadfactor = 80;
+	table->load = 0;
+	table->loadfactor = loadfactor;
+	table->flags = flags;
+	table->hash = hash ? hash : hashstring;
+	STAT(memset(&table->stats, 0, sizeof table->stats));
+	hashalloc(table, (unsigned long long)size * 100 / loadfactor + 1);
+}
+
+void hashfree(Hashtable *table)
+{
+	free(table->ents);
+	table->ents = NULL;
+	table->size = 0;
 	table->load = 0;
-	memset(table->ents, 0, sizeof table->ents);
 }
 
-void *hashfind(Hashtable *table, char *key)
+void *hashfind(Hashtable *table, const void *key, int len)
 {
 	Hashentry *ents = table->ents;
 	unsigned size = table->size;
-	unsigned pos = hash(key) % size;
+	unsigned h = table->hash(key, len);
+	unsigned home = hashslot(table, h);
+	unsigned pos = home;
 
 	while (1)
 	{
 		if (!ents[pos].val)
+		{
+			STAT(hashcount(table, home, pos, 0));
 			return NULL;
+		}
 
-		if (memcmp(key, &ents[pos].key, KEYLEN) == 0)
+		if (ents[pos].hash == h && ents[pos].len == len &&
+			memcmp(key, ents[pos].key, len) == 0)
+		{
+			STAT(hashcount(table, home, pos, 1));
 			return ents[pos].val;
+		}
 
-		pos = (pos + 1) % size;
+		pos = NEXT(size, pos);
 	}
 }
 
-/*
- * There must be space left (table->load < table->size)
- */
-void hashinsert(Hashtable *table, char *key, void *val)
+void hashinsert(Hashtable *table, const void *key, int len, void *val)
 {
 	Hashentry *ents = table->ents;
 	unsigned size = table->size;
-	unsigned pos = hash(key) % size;
+	unsigned h = table->hash(key, len);
+	unsigned pos = hashslot(table, h);
 
-	/* if (table->load > table->size * 8 / 10) hashdouble(table); */
-
-	while (1)
+	/* a key that is already there needs no slot, even in a full table */
+	while (ents[pos].val)
 	{
-		if (!ents[pos].val)
-		{
-			memcpy(ents[pos].key, key, KEYLEN);
-			ents[pos].val = val;
-			table->load ++;
+		if (ents[pos].hash == h && ents[pos].len == len &&
+			memcmp(key, ents[pos].key, len) == 0)
 			return;
-		}
 
-		if (memcmp(key, &ents[pos].key, KEYLEN) == 0)
-			return;
+		pos = NEXT(size, pos);
+	}
 
-		pos = (pos + 1) % size;
+	if (table->load >= table->maxload)
+	{
+		if (size < ((table->flags & HASHPOW2) ? MAXPOW2 : MAXPRIME))
+		{
+			hashresize(table, size * 2);
+			ents = table->ents;
+			size = table->size;
+			pos = hashslot(table, h);
+			while (ents[pos].val)
+				pos = NEXT(size, pos);
+		}
+		else if (table->load + 1 >= size)
+		{
+			/* a lookup needs an empty slot to stop at */
+			fprintf(stderr, "hashinsert: table is full\n");
+			abort();
+		}
 	}
+
+	ents[pos].key = key;
+	ents[pos].len = len;
+	ents[pos].hash = h;
+	ents[pos].val = val;
+	table->load ++;
+	STAT(table->stats.inserts ++);
 }
 
 #define MODSUB(size, look, code) \
 	(look >= code) ? look - code : size - (code - look)
 
-void hashremove(Hashtable *table, char *key)
+void hashremove(Hashtable *table, const void *key, int len)
 {
 	Hashentry *ents = table->ents;
 	unsigned size = table->size;
-	unsigned pos = hash(key) % size;
+	unsigned h = table->hash(key, len);
+	unsigned pos = hashslot(table, h);
 	unsigned hole, look, code;
 
 	while (1)
@@ -122,16 +242,17 @@ void hashremove(Hashtable *table, char *key)
 		if (!ents[pos].val)
 			return;
 
-		if (memcmp(key, &ents[pos].key, KEYLEN) == 0)
+		if (ents[pos].hash == h && ents[pos].len == len &&
+			memcmp(key, ents[pos].key, len) == 0)
 		{
 			ents[pos].val = NULL;
 
 			hole = pos;
-			look = (hole + 1) % size;
+			look = NEXT(size, hole);
 
 			while (ents[look].val)
 			{
-				code = hash(ents[look].key) % size;
+				code = hashslot(table, ents[look].hash);
 #if 0
 				if (MODSUB(table->size, look, code) >=
 					MODSUB(table->size, look, hole))
@@ -146,14 +267,15 @@ void hashremove(Hashtable *table, char *key)
 					hole = look;
 				}
 
-				look = (look + 1) % size;
+				look = NEXT(size, look);
 			}
 
 			table->load --;
+			STAT(table->stats.removes ++);
 			return;
 		}
 
-		pos = (pos + 1) % size;
+		pos = NEXT(size, pos);
 	}
 }
 
@@ -167,62 +289,156 @@ void hashdebug(Hashtable *table)
 		if (!table->ents[i].val)
 			printf("table % 4d: empty\n", i);
 		else
-			//printf("table % 4d: key=%-16.16s val=%s\n", i,
-				//	table->ents[i].key, (char*)table->ents[i].val);
-			printf("table % 4d: key=%d val=%s\n", i,
-					*(unsigned*)table->ents[i].key, (char*)table->ents[i].val);
+			printf("table % 4d: key=%-16.*s val=%s\n", i,
+					table->ents[i].len, (char*)table->ents[i].key,
+					(char*)table->ents[i].val);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Copy the counters and measure the clusters and displacements.
+ */
+void hashstats(Hashtable *table, Hashstats *stats)
 {
-	Hashtable gtable, *table = &gtable;
-	unsigned keys[] = { 8, 2, 15, 7, 1 };
+	Hashentry *ents = table->ents;
+	unsigned size = table->size;
+	unsigned i, pos, start, run, d;
+	double sum = 0;
 
-	hashinit(table);
+#ifdef HASHSTATS
+	*stats = table->stats;
+#else
+	memset(stats, 0, sizeof *stats);
+#endif
 
-	printf("GDATC 71 68 65 84 67\n");
-	hashinsert(table, (char*)(keys+0), "G");
-	hashinsert(table, (char*)(keys+1), "D");
-	hashinsert(table, (char*)(keys+2), "A");
-	hashinsert(table, (char*)(keys+3), "T");
-	hashinsert(table, (char*)(keys+4), "C");
+	stats->size = size;
+	stats->load = table->load;
+	stats->clusters = 0;
+	stats->maxcluster = 0;
+	stats->maxdisplace = 0;
+	stats->displace = 0;
+	if (!table->load)
+		return;
+
+	/* start after an empty slot so no cluster is split by the wrap around */
+	for (start = 0; ents[start].val; start++)
+		;
+
+	run = 0;
+	pos = start;
+	for (i = 0; i < size; i++)
+	{
+		pos = NEXT(size, pos);
+		if (ents[pos].val)
+		{
+			run ++;
+			d = DISTANCE(size, hashslot(table, ents[pos].hash), pos);
+			sum += d;
+			if (stats->maxdisplace < d)
+				stats->maxdisplace = d;
+		}
+		else if (run)
+		{
+			stats->clusters ++;
+			if (stats->maxcluster < run)
+				stats->maxcluster = run;
+			run = 0;
+		}
+	}
 
-	hashdebug(table);
-	printf("\n");
+	stats->displace = sum / table->load;
+}
 
-	hashremove(table, (char*)(keys+2));
+void hashresetstats(Hashtable *table)
+{
+	STAT(memset(&table->stats, 0, sizeof table->stats));
+}
 
-	hashdebug(table);
-	printf("\n");
+void hashprintstats(Hashtable *table)
+{
+	Hashstats st;
+#ifdef HASHSTATS
+	int i;
+#endif
 
-	hashremove(table, (char*)(keys+4));
+	hashstats(table, &st);
+
+	printf("cache load %d / %d (%.1f%%)\n", st.load, st.size,
+		st.size ? 100.0 * st.load / st.size : 0);
+	printf("clusters %u, mean %.2f, max %u\n", st.clusters,
+		st.clusters ? (double)st.load / st.clusters : 0, st.maxcluster);
+	printf("displacement mean %.2f, max %u\n", st.displace, st.maxdisplace);
+
+#ifdef HASHSTATS
+	printf("inserts %lu, removes %lu, resizes %lu\n",
+		st.inserts, st.removes, st.resizes);
+	printf("lookups %lu, hits %lu, misses %lu\n",
+		st.lookups, st.hits, st.misses);
+	printf("probe mean %.2f, max %lu\n",
+		st.lookups ? (double)st.probes / st.lookups : 0, st.maxprobe);
+	for (i = 0; i < HASHHIST; i++)
+		if (st.hist[i])
+			printf("probe %2d%s: %lu\n", i, i == HASHHIST - 1 ? "+" : " ", st.hist[i]);
+#endif
+}
 
-	hashdebug(table);
-	printf("\n");
+#ifdef TEST
 
-#if 0
-	hashinsert(table, "gandalf", "the gray");
-	hashinsert(table, "cugel", "the clever");
-	hashinsert(table, "rhialto", "the magnificent");
-	hashinsert(table, "buffy", "the vampire slayer");
-	hashinsert(table, "faith",
+static void insert(Hashtable *table, char *key, char *val)
+{
+	hashinsert(table, key, strlen(key), val);
+}
+
+static void remove_(Hashtable *table, char *key)
+{
+	hashremove(table, key, strlen(key));
+}
+
+int
+main(int argc, char **argv)
+{
+	Hashtable gtable, *table = &gtable;
+	char keys[100000][8];
+	int i;
+
+	hashinit(table, 8, 0, 0, NULL);
+
+	insert(table, "gandalf", "the gray");
+	insert(table, "cugel", "the clever");
+	insert(table, "rhialto", "the magnificent");
+	insert(table, "buffy", "the vampire slayer");
+	insert(table, "faith",
 		"I know Faith's not gonna be on the cover of Sanity Fair");
-	hashinsert(table, "spike", "wants a buffy-bot");
+	insert(table, "spike", "wants a buffy-bot");
 
-	hashremove(table, "faith");
-	hashremove(table, "spike");
+	remove_(table, "faith");
+	remove_(table, "spike");
 
-	hashinsert(table, "captain", "jean-luc picard");
-	hashinsert(table, "counselor", "deanna troi");
-	hashinsert(table, "commander", "william riker");
-	hashinsert(table, "security officer", "tasha yar (rip)");
-	hashinsert(table, "spoiled brat", "wesley crusher");
-	hashinsert(table, "annoying", "lwaxana troi");
+	insert(table, "captain", "jean-luc picard");
+	insert(table, "counselor", "deanna troi");
+	insert(table, "commander", "william riker");
+	insert(table, "security officer", "tasha yar (rip)");
+	insert(table, "spoiled brat", "wesley crusher");
+	insert(table, "annoying", "lwaxana troi");
 
 	hashdebug(table);
-#endif
+	printf("\n");
+
+	/* grow well past the initial size and check everything is still there */
+	for (i = 0; i < 100000; i++)
+	{
+		sprintf(keys[i], "%07d", i);
+		insert(table, keys[i], keys[i]);
+	}
+	for (i = 0; i < 100000; i += 2)
+		remove_(table, keys[i]);
+	for (i = 0; i < 100000; i++)
+		if ((hashfind(table, keys[i], 7) != NULL) != (i & 1))
+			printf("lost key %s\n", keys[i]);
+	hashprintstats(table);
+
+	hashfree(table);
 
 	return 0;
 }
 
+#endif
@@ -0,0 +1,87 @@
+#ifndef hashtable_h
+#define hashtable_h
+
+typedef struct Hashtable Hashtable;
+typedef struct Hashentry Hashentry;
+typedef struct Hashstats Hashstats;
+
+typedef unsigned (*Hashfunc)(const void *key, int len);
+
+enum { HASHPOW2 = 1 };
+
+enum { HASHHIST = 16 };
+
+/*
+ * Keys are not copied; they must stay valid while they are in the table.
+ * Values may not be NULL, since a NULL value marks an empty slot.
+ */
+struct Hashentry
+{
+	const void *key;
+	int len;
+	unsigned hash;
+	void *val;
+};
+
+/*
+ * The counters are only kept when HASHSTATS is defined, and it must then be
+ * defined for every file that includes this header. The rest is measured
+ * from the table when hashstats is called, with or without HASHSTATS.
+ */
+struct Hashstats
+{
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long probes; /* slots passed over by all lookups */
+	unsigned long maxprobe;
+	unsigned long hist[HASHHIST]; /* lookups by probe length; the last is for all longer ones */
+	unsigned long inserts;
+	unsigned long removes;
+	unsigned long resizes;
+
+	unsigned size;
+	unsigned load;
+	unsigned clusters; /* runs of full slots */
+	unsigned maxcluster;
+	unsigned maxdisplace; /* furthest any entry is from its home slot */
+	double displace; /* mean distance from home slot */
+};
+
+struct Hashtable
+{
+	unsigned size;
+	unsigned load;
+	unsigned maxload;
+	int loadfactor;
+	int flags;
+	int shift;
+	Hashfunc hash;
+	Hashentry *ents;
+#ifdef HASHSTATS
+	Hashstats stats;
+#endif
+};
+
+/*
+ * Make room for at least size entries. The table grows by rehashing when the
+ * load passes loadfactor percent (0 for the default of 80). New sizes come
+ * from a table of primes, or are powers of two if flags has HASHPOW2.
+ * A NULL hash function means hashstring.
+ */
+void hashinit(Hashtable *table, unsigned size, int loadfactor, int flags, Hashfunc hash);
+void hashfree(Hashtable *table);
+
+void *hashfind(Hashtable *table, const void *key, int len);
+void hashinsert(Hashtable *table, const void *key, int len, void *val);
+void hashremove(Hashtable *table, const void *key, int len);
+
+unsigned hashstring(const void *key, int len);
+
+void hashdebug(Hashtable *table);
+
+void hashstats(Hashtable *table, Hashstats *stats);
+void hashresetstats(Hashtable *table);
+void hashprintstats(Hashtable *table);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Benchmark hyphenation of a large text.
+ *
+ *	cc -O2 -o hyph-bench hyph-bench.c hyph.c hyphthread.c rune.c -lpthread
+ *	./hyph-bench [-n words] [-t threads] patterns|image [corpus]
+ *
+ * Without a corpus, a text of English-like words with a Zipf
+ * distribution is made up. The text is hyphenated plainly, through
+ * one cache, and by hyph_threadtext with more and more threads, and
+ * every run must find the same breaks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utf.h"
+#include "hyph.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned rnd(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static char *
+makecorpus(int nwords, int *len)
+{
+	static char *onset[] = { "", "b", "c", "d", "f", "g", "h", "l", "m", "n", "p", "r",
+		"s", "t", "v", "w", "br", "ch", "cl", "cr", "pl", "pr", "st", "str", "th", "tr" };
+	static char *nucleus[] = { "a", "e", "i", "o", "u", "ea", "io", "ou", "y" };
+	static char *coda[] = { "", "", "", "n", "r", "s", "t", "l", "m", "nd", "nt", "st", "tion" };
+	enum { VOCAB = 20000 };
+	char **vocab, *text, *p;
+	double *cum, sum, x;
+	unsigned seed = 1;
+	int i, k, n, lo, hi;
+
+	vocab = malloc(VOCAB * sizeof (char *));
+	cum = malloc(VOCAB * sizeof (double));
+	sum = 0;
+	for (i = 0; i < VOCAB; i++) {
+		vocab[i] = malloc(64);
+		p = vocab[i];
+		n = 1 + rnd(&seed) % 5;
+		for (k = 0; k < n; k++)
+			p += sprintf(p, "%s%s%s", onset[rnd(&seed) % 26], nucleus[rnd(&seed) % 9],
+				coda[rnd(&seed) % 13]);
+		sum += 1.0 / (i + 1);
+		cum[i] = sum;
+	}
+
+	text = malloc(nwords * 65 + 1);
+	p = text;
+	for (i = 0; i < nwords; i++) {
+		x = (rnd(&seed) / 16777216.0) * sum;
+		for (lo = 0, hi = VOCAB - 1; lo < hi; ) {
+			k = (lo + hi) / 2;
+			if (cum[k] < x)
+				lo = k + 1;
+			else
+				hi = k;
+		}
+		p += sprintf(p, "%s%c", vocab[lo], i % 12 == 11 ? '\n' : ' ');
+	}
+	*len = p - text;
+
+	for (i = 0; i < VOCAB; i++)
+		free(vocab[i]);
+	free(vocab);
+	free(cum);
+	return text;
+}
+
+static char *
+readfile(char *name, int *len)
+{
+	FILE *f;
+	char *buf;
+	long n;
+
+	f = fopen(name, "rb");
+	if (!f) { perror(name); exit(1); }
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(n + 1);
+	*len = fread(buf, 1, n, f);
+	buf[*len] = 0;
+	fclose(f);
+	return buf;
+}
+
+static void
+report(char *what, int threads, double t, int len, HyphCacheStats *st, double base)
+{
+	printf("%-8s %3d %8.3f %8.1f", what, threads, t, len / t / 1e6);
+	if (base > 0)
+		printf(" %7.2fx", base / t);
+	else
+		printf(" %8s", "");
+	if (st && st->lookups)
+		printf(" %6.1f%%", 100.0 * st->hits / st->lookups);
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	HyphTrie *ht;
+	TrieNode *trie;
+	HyphCache *cache;
+	HyphCacheStats st;
+	char *text;
+	int *want, *got;
+	int c, len, n, m, nwords, maxthreads, threads, next;
+	double t, tbase, tone;
+
+	nwords = 2000000;
+	maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n': nwords = atoi(optarg); break;
+		case 't': maxthreads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: hyph-bench [-n words] [-t threads] patterns|image [corpus]\n");
+			exit(1);
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: hyph-bench [-n words] [-t threads] patterns|image [corpus]\n");
+		exit(1);
+	}
+	if (maxthreads < 1)
+		maxthreads = 1;
+
+	ht = hyph_loadtrie(argv[optind]);
+	trie = NULL;
+	if (!ht) {
+		trie = hyph_readpatterns(argv[optind]);
+		if (!trie) { perror(argv[optind]); exit(1); }
+		ht = hyph_compiletrie(trie);
+		if (!ht) { fprintf(stderr, "cannot pack trie\n"); exit(1); }
+	}
+
+	if (optind + 1 < argc)
+		text = readfile(argv[optind+1], &len);
+	else
+		text = makecorpus(nwords, &len);
+
+	printf("%.1f MB of text\n", len / 1e6);
+	printf("%-8s %3s %8s %8s %8s %7s\n", "mode", "thr", "seconds", "MB/s", "speedup", "hits");
+
+	want = malloc((len + 1) * sizeof (int));
+	got = malloc((len + 1) * sizeof (int));
+
+	t = now();
+	n = hyph_text(ht, text, len, want, len + 1);
+	tbase = now() - t;
+	report("plain", 1, tbase, len, NULL, 0);
+
+	cache = hyph_newcache(ht, 8192);
+	t = now();
+	m = hyph_cachetext(cache, text, len, got, len + 1);
+	t = now() - t;
+	hyph_cachestats(cache, &st);
+	hyph_freecache(cache);
+	report("cached", 1, t, len, &st, tbase);
+	if (m != n || memcmp(want, got, n * sizeof (int)))
+		printf("cached breaks differ\n");
+	free(got);
+
+	tone = 0;
+	for (threads = 1; threads <= maxthreads; threads = next) {
+		t = now();
+		m = hyph_threadtext(ht, NULL, text, len, threads, &got, &st);
+		t = now() - t;
+		if (threads == 1)
+			tone = t;
+		report("threads", threads, t, len, &st, tone);
+		if (m != n || memcmp(want, got, n * sizeof (int)))
+			printf("threaded breaks differ\n");
+		free(got);
+		next = threads * 2;
+		if (threads < maxthreads && next > maxthreads)
+			next = maxthreads;
+	}
+
+	printf("%d breaks\n", n);
+
+	free(want);
+	free(text);
+	hyph_freecompiled(ht);
+	if (trie)
+		hyph_freetrie(trie);
+
+	return 0;
+}
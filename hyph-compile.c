@@ -0,0 +1,40 @@
+/*
+ * Compile a pattern file into a packed trie image for hyph_loadtrie.
+ *
+ *	cc -o hyph-compile hyph-compile.c hyph.c rune.c
+ *	./hyph-compile hyphen.tex hyphen.hyb
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utf.h"
+#include "hyph.h"
+
+int
+main(int argc, char **argv)
+{
+	TrieNode *trie;
+	HyphTrie *ht;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: hyph-compile patterns image\n");
+		exit(1);
+	}
+
+	trie = hyph_readpatterns(argv[1]);
+	if (!trie) { perror(argv[1]); exit(1); }
+
+	ht = hyph_compiletrie(trie);
+	if (!ht) { fprintf(stderr, "%s: cannot pack trie\n", argv[1]); exit(1); }
+
+	if (hyph_savetrie(ht, argv[2]) < 0) { perror(argv[2]); exit(1); }
+
+	printf("%s: %d slots, %d classes, %d value bytes\n",
+		argv[2], ht->nslots, ht->nclasses, ht->nvals);
+
+	hyph_freecompiled(ht);
+	hyph_freetrie(trie);
+
+	return 0;
+}
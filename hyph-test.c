@@ -9,15 +9,35 @@ extern int memuse, numnodes;
 int numpats;
 int mempat;
 
+#define nelem(a) (sizeof (a) / sizeof (a)[0])
+
+static void
+printbreaks(char *text, int len, int *breaks, int n)
+{
+	int i, k;
+
+	for (i = k = 0; i < len; i++) {
+		if (k < n && breaks[k] == i) {
+			putchar('+');
+			k ++;
+		}
+		putchar(text[i]);
+	}
+	putchar('\n');
+}
+
 int
 main(int argc, char **argv)
 {
 	char buf[256];
-	Rune word[256];
-	char vals[256];
+	int breaks[256];
 	TrieNode *hyph;
-	char *s;
-	int k;
+	HyphTrie *packed;
+	HyphCache *cache;
+	HyphCacheStats st;
+	char *exc;
+	long len;
+	int n;
 	FILE *f;
 	Rune patstr[256];
 	char patvalbuf[256];
@@ -32,6 +52,15 @@ main(int argc, char **argv)
 	if (argc > 1)
 		strcpy(buf, argv[1]);
 
+	/* a compiled image needs no parsing */
+	packed = hyph_loadtrie(buf);
+	if (packed) {
+		printf("Mapped [%d bytes; %d slots; %d classes].\n",
+			packed->size, packed->nslots, packed->nclasses);
+		hyph = NULL;
+		goto ready;
+	}
+
 	hyph = malloc(sizeof (TrieNode));
 	hyph->patlen = 0;
 	hyph->patval = NULL;
@@ -56,7 +85,28 @@ main(int argc, char **argv)
 	printf("sizeof node = %d\n", sizeof (TrieNode));
 	printf("Done [%d+%d bytes used; %d nodes; %d patterns].\n", memuse, mempat, numnodes, numpats);
 //	printf("nt=%d na=%d np=%d\n", numtrie, numarc, numpat);
-	printf("Type word to hyphenate:\n");
+
+	packed = hyph_compiletrie(hyph);
+	if (!packed) { fprintf(stderr, "cannot pack trie\n"); exit(1); }
+	printf("Packed [%d bytes used; %d slots; %d classes; %d value bytes].\n",
+		packed->size, packed->nslots, packed->nclasses, packed->nvals);
+
+ready:
+	cache = hyph_newcache(packed, 4096);
+	if (argc > 2) {
+		f = fopen(argv[2], "r");
+		if (!f) { perror(argv[2]); exit(1); }
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		exc = malloc(len + 1);
+		exc[fread(exc, 1, len, f)] = '\0';
+		fclose(f);
+		printf("%d exceptions.\n", hyph_addexceptions(cache, exc));
+		free(exc);
+	}
+
+	printf("Type text to hyphenate:\n");
 
 	while (!feof(stdin)) {
 		fgets(buf, 256, stdin);
@@ -66,18 +116,20 @@ main(int argc, char **argv)
 		if (strcmp(buf, ".") == 0)
 			break;
 
-		/* build word to hyphenate, surround with '.' and strip illegal chars */
-		k = 0;
-		word[k++] = '.';
-		s = buf;
-		do {
-			s += chartorune(&word[k++], s);
-		} while (*s != '\0');
-		word[k++] = '.';
-		hyph_hyphenate(hyph, word, vals, k);
+		n = hyph_cachetext(cache, buf, strlen(buf), breaks, nelem(breaks));
+		if (n > nelem(breaks))
+			n = nelem(breaks);
+		printbreaks(buf, strlen(buf), breaks, n);
 	}
 
-	hyph_freetrie(hyph);
+	hyph_cachestats(cache, &st);
+	fprintf(stderr, "%ld words: %ld hits, %ld misses, %ld exceptions, %ld uncached, %ld evictions\n",
+		st.lookups, st.hits, st.misses, st.exceptions, st.uncached, st.evictions);
+
+	hyph_freecache(cache);
+	hyph_freecompiled(packed);
+	if (hyph)
+		hyph_freetrie(hyph);
 
 	return 0;
 }
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utf.h"
 #include "hyph.h"
@@ -139,3 +144,1133 @@ hyph_hyphenate(TrieNode *trie, Rune *word, char *vals, int len)
 	}
 	putchar('\n');
 }
+
+/*
+ * Pack the linked trie into one block, Liang style: the arcs of
+ * all nodes are interleaved in a single array of slots, so that
+ * following an arc is one index and one compare. Pattern values
+ * are kept once each as (position, value) pairs of their nonzero
+ * digits, and runes are mapped to small classes first.
+ */
+
+typedef struct Packer		Packer;
+
+struct Packer
+{
+	HyphTrie	*ht;
+	HyphSlot	*slots;
+	unsigned char	*used;		/* bases already taken */
+	int		cap;
+	int		maxbase;
+	int		firstfree;
+	unsigned char	*vals;
+	int		nvals, capvals;
+	int		*dedup;		/* vals offsets by hash, 0 if empty */
+	int		ndedup;
+	Rune		*runes;
+	int		nrunes, caprunes;
+	int		npats;
+	int		err;
+};
+
+static int
+hyph_class(HyphTrie *ht, Rune r)
+{
+	int lo, hi, mid;
+
+	if (r < 256)
+		return ht->lowmap[r];
+
+	lo = 0;
+	hi = ht->nbig - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ht->big[mid] < r)
+			lo = mid + 1;
+		else if (ht->big[mid] > r)
+			hi = mid - 1;
+		else
+			return ht->nclasses - ht->nbig + mid + 1;
+	}
+	return 0;
+}
+
+static int
+hyph_cmprune(const void *a, const void *b)
+{
+	Rune x = *(const Rune *)a, y = *(const Rune *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+hyph_collect(Packer *p, TrieNode *node)
+{
+	TrieNode *arc;
+	int i;
+
+	if (node->patval)
+		p->npats ++;
+
+	for (arc = node->child; arc; arc = arc->next) {
+		for (i = 0; i < p->nrunes; i++)
+			if (p->runes[i] == arc->ch)
+				break;
+		if (i == p->nrunes) {
+			if (p->nrunes == p->caprunes) {
+				p->caprunes = p->caprunes ? p->caprunes * 2 : 64;
+				p->runes = realloc(p->runes, p->caprunes * sizeof (Rune));
+			}
+			p->runes[p->nrunes++] = arc->ch;
+		}
+		hyph_collect(p, arc);
+	}
+}
+
+static void
+hyph_growslots(Packer *p, int need)
+{
+	int cap = p->cap;
+
+	if (need <= cap)
+		return;
+	while (cap < need)
+		cap = cap ? cap * 2 : 1024;
+	p->slots = realloc(p->slots, cap * sizeof (HyphSlot));
+	p->used = realloc(p->used, cap);
+	memset(p->slots + p->cap, 0, (cap - p->cap) * sizeof (HyphSlot));
+	memset(p->used + p->cap, 0, cap - p->cap);
+	p->cap = cap;
+}
+
+static unsigned int
+hyph_addvals(Packer *p, TrieNode *node)
+{
+	unsigned char buf[512];
+	unsigned int h;
+	int n, k, off;
+
+	if (!node->patval)
+		return 0;
+
+	n = 0;
+	for (k = 0; k < node->patlen + 1; k++) {
+		if (node->patval[k]) {
+			if (k + 1 > 255 || n + 3 > sizeof buf) {
+				p->err = 1;
+				return 0;
+			}
+			buf[n++] = k + 1;
+			buf[n++] = node->patval[k];
+		}
+	}
+	if (n == 0)
+		return 0;
+	buf[n++] = 0;
+
+	h = 2166136261u;
+	for (k = 0; k < n; k++)
+		h = (h ^ buf[k]) * 16777619;
+
+	for (h &= p->ndedup - 1; p->dedup[h]; h = (h + 1) & (p->ndedup - 1))
+		if (memcmp(p->vals + p->dedup[h], buf, n) == 0)
+			return p->dedup[h];
+
+	if (p->nvals + n > p->capvals) {
+		while (p->nvals + n > p->capvals)
+			p->capvals *= 2;
+		p->vals = realloc(p->vals, p->capvals);
+	}
+	off = p->nvals;
+	memcpy(p->vals + off, buf, n);
+	p->nvals += n;
+	p->dedup[h] = off;
+	if (off >= 1 << 24)
+		p->err = 1;
+	return off;
+}
+
+/* Place the arcs out of node and return its base, or 0 if it has none. */
+static unsigned int
+hyph_pack(Packer *p, TrieNode *node)
+{
+	TrieNode *kid[256], *arc, *tn;
+	int cls[256];
+	int n, i, j, c, b;
+
+	n = 0;
+	for (arc = node->child; arc; arc = arc->next) {
+		c = hyph_class(p->ht, arc->ch);
+		for (j = n; j > 0 && cls[j-1] > c; j--) {
+			cls[j] = cls[j-1];
+			kid[j] = kid[j-1];
+		}
+		cls[j] = c;
+		kid[j] = arc;
+		n ++;
+	}
+	if (n == 0)
+		return 0;
+
+	b = p->firstfree - cls[0];
+	if (b < 1)
+		b = 1;
+	for (;; b++) {
+		hyph_growslots(p, b + p->ht->nclasses + 1);
+		if (p->used[b])
+			continue;
+		for (i = 0; i < n; i++)
+			if (p->slots[b + cls[i]].arc)
+				break;
+		if (i == n)
+			break;
+	}
+
+	p->used[b] = 1;
+	if (p->maxbase < b)
+		p->maxbase = b;
+	for (i = 0; i < n; i++)
+		p->slots[b + cls[i]].arc = cls[i];
+	while (p->slots[p->firstfree].arc)
+		p->firstfree ++;
+
+	/* hyph_pack may move the slots, so assign through a fresh index */
+	for (i = 0; i < n; i++) {
+		tn = kid[i];
+		p->slots[b + cls[i]].arc |= hyph_addvals(p, tn) << 8;
+		c = hyph_pack(p, tn);
+		p->slots[b + cls[i]].base = c;
+	}
+
+	return b;
+}
+
+HyphTrie *
+hyph_compiletrie(TrieNode *trie)
+{
+	Packer p;
+	HyphTrie tmp, *ht;
+	unsigned char *mem;
+	int i, size;
+
+	memset(&p, 0, sizeof p);
+	memset(&tmp, 0, sizeof tmp);
+	hyph_collect(&p, trie);
+	if (p.nrunes > 255) {
+		free(p.runes);
+		return NULL;
+	}
+
+	/* classes follow rune order */
+	qsort(p.runes, p.nrunes, sizeof (Rune), hyph_cmprune);
+	tmp.nclasses = p.nrunes;
+	for (i = 0; i < p.nrunes && p.runes[i] < 256; i++)
+		tmp.lowmap[p.runes[i]] = i + 1;
+	tmp.big = p.runes + i;
+	tmp.nbig = p.nrunes - i;
+
+	p.ht = &tmp;
+	p.firstfree = 1;
+	p.capvals = 1024;
+	p.vals = malloc(p.capvals);
+	p.vals[0] = 0;
+	p.nvals = 1;
+	for (p.ndedup = 64; p.ndedup < p.npats * 2; p.ndedup *= 2)
+		;
+	p.dedup = calloc(p.ndedup, sizeof (int));
+
+	tmp.root = hyph_pack(&p, trie);
+	tmp.nslots = p.maxbase + tmp.nclasses + 1;
+	tmp.nvals = p.nvals;
+	hyph_growslots(&p, tmp.nslots);
+
+	ht = NULL;
+	if (!p.err) {
+		size = sizeof (HyphTrie) + tmp.nslots * sizeof (HyphSlot) +
+			tmp.nbig * sizeof (Rune) + tmp.nvals;
+		mem = malloc(size);
+		ht = (HyphTrie *)mem;
+		*ht = tmp;
+		ht->size = size;
+		ht->slots = (HyphSlot *)(mem + sizeof (HyphTrie));
+		ht->big = (Rune *)(ht->slots + ht->nslots);
+		ht->vals = (unsigned char *)(ht->big + ht->nbig);
+		memcpy(ht->slots, p.slots, tmp.nslots * sizeof (HyphSlot));
+		memcpy(ht->big, tmp.big, tmp.nbig * sizeof (Rune));
+		memcpy(ht->vals, p.vals, tmp.nvals);
+		ht->map = NULL;
+		ht->maplen = 0;
+	}
+
+	free(p.slots);
+	free(p.used);
+	free(p.vals);
+	free(p.dedup);
+	free(p.runes);
+	return ht;
+}
+
+void
+hyph_freecompiled(HyphTrie *ht)
+{
+	if (ht->map)
+		munmap(ht->map, ht->maplen);
+	free(ht);
+}
+
+/*
+ * Scratch space for one word, on the stack unless the word is long.
+ */
+
+enum { HYPHSTACK = 128 };
+
+typedef struct Scratch		Scratch;
+
+struct Scratch
+{
+	int		cap;
+	unsigned char	*cls;
+	char		*vals;
+	int		*offs;
+	Rune		*runes;
+	unsigned char	scls[HYPHSTACK];
+	char		svals[HYPHSTACK];
+	int		soffs[HYPHSTACK];
+	Rune		srunes[HYPHSTACK];
+};
+
+static void
+hyph_initscratch(Scratch *s)
+{
+	s->cap = HYPHSTACK;
+	s->cls = s->scls;
+	s->vals = s->svals;
+	s->offs = s->soffs;
+	s->runes = s->srunes;
+}
+
+static void
+hyph_freescratch(Scratch *s)
+{
+	if (s->cls != s->scls) {
+		free(s->cls);
+		free(s->vals);
+		free(s->offs);
+		free(s->runes);
+	}
+}
+
+/* Grow to hold n, keeping what is there. */
+static void
+hyph_reserve(Scratch *s, int n)
+{
+	Scratch t;
+
+	if (n <= s->cap)
+		return;
+	t.cap = s->cap;
+	while (t.cap < n)
+		t.cap *= 2;
+	t.cls = malloc(t.cap);
+	t.vals = malloc(t.cap);
+	t.offs = malloc(t.cap * sizeof (int));
+	t.runes = malloc(t.cap * sizeof (Rune));
+	memcpy(t.cls, s->cls, s->cap);
+	memcpy(t.vals, s->vals, s->cap);
+	memcpy(t.offs, s->offs, s->cap * sizeof (int));
+	memcpy(t.runes, s->runes, s->cap * sizeof (Rune));
+	hyph_freescratch(s);
+	s->cap = t.cap;
+	s->cls = t.cls;
+	s->vals = t.vals;
+	s->offs = t.offs;
+	s->runes = t.runes;
+}
+
+/* The values for a word already mapped to classes; vals needs len + 1 entries. */
+static void
+hyph_classvalues(HyphTrie *ht, unsigned char *cls, char *vals, int len)
+{
+	HyphSlot *slots = ht->slots;
+	HyphSlot *slot;
+	unsigned char *v;
+	unsigned int b;
+	int i, j, c;
+
+	memset(vals, 0, len + 1);
+
+	for (i = 0; i < len; i++) {
+		b = ht->root;
+		for (j = i; j < len && b; j++) {
+			c = cls[j];
+			if (!c)
+				break;
+			slot = &slots[b + c];
+			if (HYPHCLASS(slot) != c)
+				break;
+			for (v = ht->vals + HYPHVALS(slot); *v; v += 2)
+				if (vals[i + v[0] - 1] < v[1])
+					vals[i + v[0] - 1] = v[1];
+			b = slot->base;
+		}
+	}
+}
+
+/*
+ * Like hyph_hyphenate, but only fills in the values, from a packed trie.
+ */
+void
+hyph_patternvalues(HyphTrie *ht, Rune *word, char *vals, int len)
+{
+	Scratch s;
+	int i;
+
+	hyph_initscratch(&s);
+	hyph_reserve(&s, len);
+	for (i = 0; i < len; i++)
+		s.cls[i] = hyph_class(ht, word[i]);
+	hyph_classvalues(ht, s.cls, vals, len);
+	hyph_freescratch(&s);
+}
+
+/*
+ * Read a pattern file, one pattern per line, into a new trie.
+ */
+TrieNode *
+hyph_readpatterns(char *filename)
+{
+	char buf[256], vbuf[256];
+	Rune patstr[256];
+	TrieNode *trie;
+	char *patval;
+	int n, patlen;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+
+	trie = malloc(sizeof (TrieNode));
+	trie->patlen = 0;
+	trie->patval = NULL;
+	trie->ch = 0;
+	trie->child = NULL;
+	trie->next = NULL;
+
+	while (fgets(buf, sizeof buf, f)) {
+		n = strlen(buf);
+		while (n > 0 && (buf[n-1] == '\n' || buf[n-1] == '\r'))
+			buf[--n] = '\0';
+		if (n == 0)
+			continue;
+		patlen = hyph_makepattern(buf, patstr, vbuf);
+		patval = malloc(patlen + 1);
+		memcpy(patval, vbuf, patlen + 1);
+		hyph_integratepattern(trie, patstr, patval, patlen, 0);
+	}
+
+	fclose(f);
+	return trie;
+}
+
+/*
+ * A packed trie on disk is this header followed by the slots, the
+ * big runes and the values, in host byte order. There are no
+ * pointers in it, so hyph_loadtrie can use a shared read-only
+ * mapping of the file as it is.
+ */
+
+enum { HYPHMAGIC = 0x48595048, HYPHVERSION = 1 };
+
+typedef struct HyphHeader	HyphHeader;
+
+struct HyphHeader
+{
+	unsigned int	magic;
+	unsigned int	version;
+	unsigned int	nslots;
+	unsigned int	nclasses;
+	unsigned int	nbig;
+	unsigned int	nvals;
+	unsigned int	root;
+	unsigned char	lowmap[256];
+};
+
+int
+hyph_savetrie(HyphTrie *ht, char *filename)
+{
+	HyphHeader h;
+	FILE *f;
+	int ok;
+
+	memset(&h, 0, sizeof h);
+	h.magic = HYPHMAGIC;
+	h.version = HYPHVERSION;
+	h.nslots = ht->nslots;
+	h.nclasses = ht->nclasses;
+	h.nbig = ht->nbig;
+	h.nvals = ht->nvals;
+	h.root = ht->root;
+	memcpy(h.lowmap, ht->lowmap, sizeof h.lowmap);
+
+	f = fopen(filename, "wb");
+	if (!f)
+		return -1;
+	ok = fwrite(&h, sizeof h, 1, f) == 1 &&
+		fwrite(ht->slots, sizeof (HyphSlot), ht->nslots, f) == ht->nslots &&
+		fwrite(ht->big, sizeof (Rune), ht->nbig, f) == ht->nbig &&
+		fwrite(ht->vals, 1, ht->nvals, f) == ht->nvals;
+	if (fclose(f))
+		ok = 0;
+	return ok ? 0 : -1;
+}
+
+/*
+ * Walk every node a lookup can reach and check that its arcs stay in
+ * the slots, that no node is reached twice, and that the values of an
+ * arc end inside vals and only touch the letters matched so far, so
+ * that hyph_classvalues cannot go astray in a damaged image.
+ */
+static int
+hyph_checktrie(HyphTrie *ht)
+{
+	unsigned int *stack, *depth;
+	unsigned char *seen;
+	HyphSlot *slot;
+	unsigned int b, d, v, c;
+	int i, n, ok;
+
+	for (i = 0; i < 256; i++)
+		if (ht->lowmap[i] > ht->nclasses)
+			return 0;
+	if (ht->root == 0)
+		return 1;
+
+	stack = malloc(ht->nslots * sizeof (unsigned int));
+	depth = malloc(ht->nslots * sizeof (unsigned int));
+	seen = calloc(ht->nslots, 1);
+	ok = 1;
+	n = 0;
+	stack[n] = ht->root;
+	depth[n++] = 0;
+	seen[ht->root] = 1;
+	while (ok && n > 0) {
+		n --;
+		b = stack[n];
+		d = depth[n];
+		for (c = 1; ok && c <= ht->nclasses; c++) {
+			slot = &ht->slots[b + c];
+			if (HYPHCLASS(slot) != c)
+				continue;
+			for (v = HYPHVALS(slot); ; v += 2) {
+				if (v >= ht->nvals) {
+					ok = 0;
+					break;
+				}
+				if (ht->vals[v] == 0)
+					break;
+				if (v + 1 >= ht->nvals || ht->vals[v] > d + 2) {
+					ok = 0;
+					break;
+				}
+			}
+			if (!ok || slot->base == 0)
+				continue;
+			if ((unsigned long long)slot->base + ht->nclasses >= ht->nslots || seen[slot->base]) {
+				ok = 0;
+				break;
+			}
+			seen[slot->base] = 1;
+			stack[n] = slot->base;
+			depth[n++] = d + 1;
+		}
+	}
+
+	free(stack);
+	free(depth);
+	free(seen);
+	return ok;
+}
+
+HyphTrie *
+hyph_loadtrie(char *filename)
+{
+	HyphHeader *h;
+	HyphTrie *ht;
+	struct stat st;
+	unsigned char *mem;
+	long long need;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof (HyphHeader)) {
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	h = (HyphHeader *)mem;
+	need = sizeof (HyphHeader) + (long long)h->nslots * sizeof (HyphSlot) +
+		(long long)h->nbig * sizeof (Rune) + h->nvals;
+	if (h->magic != HYPHMAGIC || h->version != HYPHVERSION ||
+		need != st.st_size || h->nclasses > 255 || h->nbig > h->nclasses ||
+		h->nvals == 0 || h->root + h->nclasses >= h->nslots) {
+		munmap(mem, st.st_size);
+		return NULL;
+	}
+
+	ht = malloc(sizeof (HyphTrie));
+	ht->size = sizeof (HyphTrie) + st.st_size;
+	ht->nslots = h->nslots;
+	ht->nclasses = h->nclasses;
+	ht->nbig = h->nbig;
+	ht->nvals = h->nvals;
+	ht->root = h->root;
+	memcpy(ht->lowmap, h->lowmap, sizeof ht->lowmap);
+	ht->slots = (HyphSlot *)(mem + sizeof (HyphHeader));
+	ht->big = (Rune *)(ht->slots + ht->nslots);
+	ht->vals = (unsigned char *)(ht->big + ht->nbig);
+	ht->map = mem;
+	ht->maplen = st.st_size;
+	if (!hyph_checktrie(ht)) {
+		munmap(mem, st.st_size);
+		free(ht);
+		return NULL;
+	}
+	return ht;
+}
+
+/*
+ * Hyphenating running text.
+ *
+ * A word is a run of letters. Words are matched in lower case with
+ * the dots around them added here, and words with letters outside
+ * the alphabet of the patterns are left alone. There are no rune
+ * type tables in this tree, so case folding and the test for a
+ * letter only know about ASCII and Latin-1 beyond the alphabet.
+ */
+
+static int
+hyph_isletter(HyphTrie *ht, Rune r)
+{
+	if (r < 0x80)
+		return (r >= 'a' && r <= 'z') || (r >= 'A' && r <= 'Z') ||
+			(r != '.' && hyph_class(ht, r));
+	if (r < 0x100)
+		return r >= 0xC0 && r != 0xD7 && r != 0xF7;
+	/* general punctuation, and the odd spaces */
+	return !(r >= 0x2000 && r < 0x2070) && r != 0x3000 && r != 0xFEFF;
+}
+
+static Rune
+hyph_fold(Rune r)
+{
+	if ((r >= 'A' && r <= 'Z') || (r >= 0xC0 && r <= 0xDE && r != 0xD7))
+		return r + 32;
+	return r;
+}
+
+/*
+ * Results cache and exceptions.
+ *
+ * Words are looked up as folded UTF-8. The breaks of a word are a
+ * bit mask of rune positions, so only words of up to 64 letters can
+ * be exceptions or be cached. Exceptions are kept for good; cached
+ * words are replaced in CLOCK order once the cache is full.
+ */
+
+enum { HYPHMAXWORD = 64, HYPHKEYMAX = 30 };
+
+typedef struct HyphEntry	HyphEntry;
+typedef struct HyphExcept	HyphExcept;
+
+struct HyphEntry
+{
+	unsigned long long	mask;
+	unsigned int	hash;
+	int		next;		/* in the hash chain, -1 at the end */
+	unsigned char	len;
+	unsigned char	ref;
+	char		key[HYPHKEYMAX];
+};
+
+struct HyphExcept
+{
+	unsigned long long	mask;
+	unsigned int	hash;
+	int		next;
+	int		key;		/* offset in pool */
+	int		len;
+};
+
+struct HyphCache
+{
+	HyphTrie	*ht;
+	HyphEntry	*ents;
+	int		*head;		/* first entry by hash, -1 if none */
+	int		size;		/* power of two */
+	int		count;
+	int		hand;
+
+	HyphExcept	*excs;
+	int		*exchead;
+	int		nexcs, capexcs, excsize;
+	char		*pool;
+	int		npool, cappool;
+
+	HyphCacheStats	stats;
+};
+
+static unsigned int
+hyph_hash(char *key, int len)
+{
+	unsigned int h = 2166136261u;
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*key++) * 16777619;
+	return h;
+}
+
+/* Encode the folded runes of a word; return the length, or -1 if too long. */
+static int
+hyph_key(Rune *runes, int n, char *key)
+{
+	int i, k;
+
+	if (n > HYPHMAXWORD)
+		return -1;
+	for (i = k = 0; i < n; i++) {
+		if (runes[i] < Runeself)
+			key[k++] = runes[i];
+		else
+			k += runetochar(key + k, &runes[i]);
+	}
+	return k;
+}
+
+HyphCache *
+hyph_newcache(HyphTrie *ht, int nentries)
+{
+	HyphCache *c;
+	int i;
+
+	c = calloc(1, sizeof (HyphCache));
+	c->ht = ht;
+	for (c->size = 64; c->size < nentries; c->size *= 2)
+		;
+	c->ents = malloc(c->size * sizeof (HyphEntry));
+	c->head = malloc(c->size * sizeof (int));
+	for (i = 0; i < c->size; i++)
+		c->head[i] = -1;
+	return c;
+}
+
+void
+hyph_freecache(HyphCache *c)
+{
+	free(c->ents);
+	free(c->head);
+	free(c->excs);
+	free(c->exchead);
+	free(c->pool);
+	free(c);
+}
+
+void
+hyph_cachestats(HyphCache *c, HyphCacheStats *stats)
+{
+	*stats = c->stats;
+}
+
+static HyphExcept *
+hyph_findexception(HyphCache *c, unsigned int h, char *key, int len)
+{
+	HyphExcept *e;
+	int i;
+
+	if (!c->nexcs)
+		return NULL;
+	for (i = c->exchead[h & (c->excsize - 1)]; i >= 0; i = e->next) {
+		e = &c->excs[i];
+		if (e->hash == h && e->len == len && memcmp(c->pool + e->key, key, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void
+hyph_rehashexceptions(HyphCache *c, int size)
+{
+	int i, b;
+
+	free(c->exchead);
+	c->excsize = size;
+	c->exchead = malloc(size * sizeof (int));
+	for (i = 0; i < size; i++)
+		c->exchead[i] = -1;
+	for (i = 0; i < c->nexcs; i++) {
+		b = c->excs[i].hash & (size - 1);
+		c->excs[i].next = c->exchead[b];
+		c->exchead[b] = i;
+	}
+}
+
+static void
+hyph_addexception(HyphCache *c, Rune *runes, int n, unsigned long long mask)
+{
+	char key[HYPHMAXWORD * UTFmax];
+	HyphExcept *e;
+	unsigned int h;
+	int len;
+
+	len = hyph_key(runes, n, key);
+	if (len < 0)
+		return;
+	h = hyph_hash(key, len);
+
+	e = hyph_findexception(c, h, key, len);
+	if (e) {
+		e->mask = mask;
+		return;
+	}
+
+	if (c->nexcs == c->capexcs) {
+		c->capexcs = c->capexcs ? c->capexcs * 2 : 64;
+		c->excs = realloc(c->excs, c->capexcs * sizeof (HyphExcept));
+	}
+	if (c->npool + len > c->cappool) {
+		while (c->npool + len > c->cappool)
+			c->cappool = c->cappool ? c->cappool * 2 : 1024;
+		c->pool = realloc(c->pool, c->cappool);
+	}
+
+	e = &c->excs[c->nexcs++];
+	e->mask = mask;
+	e->hash = h;
+	e->key = c->npool;
+	e->len = len;
+	memcpy(c->pool + c->npool, key, len);
+	c->npool += len;
+
+	if (c->nexcs > c->excsize)
+		hyph_rehashexceptions(c, c->excsize ? c->excsize * 2 : 64);
+	else {
+		e->next = c->exchead[h & (c->excsize - 1)];
+		c->exchead[h & (c->excsize - 1)] = c->nexcs - 1;
+	}
+}
+
+/*
+ * hyph_addexceptions: Add words hyphenated by hand, as in TeX's
+ * \hyphenation{ta-ble hy-phen-ation}; the command and the braces
+ * may be left out. An exception replaces the patterns for that
+ * word in every case. Return the number of words added.
+ */
+int
+hyph_addexceptions(HyphCache *c, char *text)
+{
+	Rune runes[HYPHMAXWORD + 1], r;
+	unsigned long long mask;
+	int n, count, k;
+
+	count = 0;
+	while (*text) {
+		/* skip space, braces and control words */
+		if (*text == '\\') {
+			for (text++; *text && *text != '{' && *text != ' ' && *text != '\t' && *text != '\n'; text++)
+				;
+			continue;
+		}
+		if (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r' ||
+			*text == '{' || *text == '}') {
+			text ++;
+			continue;
+		}
+
+		n = 0;
+		mask = 0;
+		while (*text && *text != ' ' && *text != '\t' && *text != '\n' &&
+			*text != '\r' && *text != '{' && *text != '}') {
+			k = chartorune(&r, text);
+			text += k;
+			if (r == '-') {
+				if (n > 0 && n < HYPHMAXWORD)
+					mask |= 1ull << n;
+			} else if (n <= HYPHMAXWORD) {
+				runes[n++] = hyph_fold(r);
+			}
+		}
+		if (n > 0 && n <= HYPHMAXWORD) {
+			hyph_addexception(c, runes, n, mask);
+			count ++;
+		}
+	}
+	return count;
+}
+
+static HyphEntry *
+hyph_findcached(HyphCache *c, unsigned int h, char *key, int len)
+{
+	HyphEntry *e;
+	int i;
+
+	for (i = c->head[h & (c->size - 1)]; i >= 0; i = e->next) {
+		e = &c->ents[i];
+		if (e->hash == h && e->len == len && memcmp(e->key, key, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void
+hyph_addcached(HyphCache *c, unsigned int h, char *key, int len, unsigned long long mask)
+{
+	HyphEntry *e;
+	int i, *p;
+
+	if (c->count < c->size) {
+		i = c->count++;
+	} else {
+		/* second chance for the recently used */
+		while (c->ents[c->hand].ref) {
+			c->ents[c->hand].ref = 0;
+			c->hand = (c->hand + 1) & (c->size - 1);
+		}
+		i = c->hand;
+		c->hand = (c->hand + 1) & (c->size - 1);
+		for (p = &c->head[c->ents[i].hash & (c->size - 1)]; *p != i; p = &c->ents[*p].next)
+			;
+		*p = c->ents[i].next;
+		c->stats.evictions ++;
+	}
+
+	e = &c->ents[i];
+	e->mask = mask;
+	e->hash = h;
+	e->len = len;
+	e->ref = 0;
+	memcpy(e->key, key, len);
+	e->next = c->head[h & (c->size - 1)];
+	c->head[h & (c->size - 1)] = i;
+}
+
+static int
+hyph_emitmask(Scratch *s, unsigned long long mask, int *breaks, int nbreaks, int maxbreaks)
+{
+	int i;
+
+	for (i = 1; mask; i++) {
+		if (mask & (1ull << i)) {
+			if (nbreaks < maxbreaks)
+				breaks[nbreaks] = s->offs[i];
+			nbreaks ++;
+			mask &= ~(1ull << i);
+		}
+	}
+	return nbreaks;
+}
+
+/*
+ * s holds the folded runes of a word of n letters; look it up, or frame
+ * it, find its values, and store the offs[] of its break points. Return
+ * the new number of breaks.
+ */
+static int
+hyph_breakword(HyphTrie *ht, HyphCache *c, Scratch *s, int n, int *breaks, int nbreaks, int maxbreaks)
+{
+	char key[HYPHMAXWORD * UTFmax];
+	unsigned long long mask;
+	HyphExcept *x;
+	HyphEntry *e;
+	unsigned int h;
+	int i, len, dot;
+
+	len = -1;
+	h = 0;
+	if (c) {
+		c->stats.lookups ++;
+		len = hyph_key(s->runes, n, key);
+		if (len < 0) {
+			c->stats.misses ++;
+			c->stats.uncached ++;
+		} else {
+			h = hyph_hash(key, len);
+			x = hyph_findexception(c, h, key, len);
+			if (x) {
+				c->stats.exceptions ++;
+				return hyph_emitmask(s, x->mask, breaks, nbreaks, maxbreaks);
+			}
+			e = hyph_findcached(c, h, key, len);
+			if (e) {
+				c->stats.hits ++;
+				e->ref = 1;
+				return hyph_emitmask(s, e->mask, breaks, nbreaks, maxbreaks);
+			}
+			c->stats.misses ++;
+			if (len > HYPHKEYMAX) {
+				c->stats.uncached ++;
+				len = -1;
+			}
+		}
+	}
+
+	mask = 0;
+	for (i = 1; i <= n; i++)
+		if (!(s->cls[i] = hyph_class(ht, s->runes[i-1])))
+			break;
+	if (i > n && n >= HYPHLEFTMIN + HYPHRIGHTMIN) {
+		dot = hyph_class(ht, '.');
+		s->cls[0] = dot;
+		s->cls[n+1] = dot;
+		hyph_classvalues(ht, s->cls, s->vals, n + 2);
+
+		for (i = HYPHLEFTMIN; i <= n - HYPHRIGHTMIN; i++) {
+			if (s->vals[i+1] & 1) {
+				if (nbreaks < maxbreaks)
+					breaks[nbreaks] = s->offs[i];
+				nbreaks ++;
+				if (i < HYPHMAXWORD)
+					mask |= 1ull << i;
+			}
+		}
+	}
+
+	if (c && len >= 0)
+		hyph_addcached(c, h, key, len, mask);
+	return nbreaks;
+}
+
+/*
+ * hyph_word: Fill vals[0..len] for a single word without dots; vals[i] is
+ * odd if the word may break before word[i]. Return the number of breaks.
+ */
+int
+hyph_word(HyphTrie *ht, Rune *word, int len, char *vals)
+{
+	Scratch s;
+	int sbreaks[HYPHSTACK], *breaks;
+	int i, n;
+
+	hyph_initscratch(&s);
+	hyph_reserve(&s, len + 3);
+	for (i = 0; i < len; i++) {
+		s.runes[i] = hyph_fold(word[i]);
+		s.offs[i] = i;
+	}
+
+	/* apart from offs, which the breaks are read from */
+	breaks = sbreaks;
+	if (len > HYPHSTACK)
+		breaks = malloc(len * sizeof (int));
+
+	memset(vals, 0, len + 1);
+	n = hyph_breakword(ht, NULL, &s, len, breaks, 0, len);
+	for (i = 0; i < n; i++)
+		vals[breaks[i]] = 1;
+	if (breaks != sbreaks)
+		free(breaks);
+	hyph_freescratch(&s);
+	return n;
+}
+
+static int
+hyph_scanrunes(HyphTrie *ht, HyphCache *c, Rune *text, int len, int *breaks, int maxbreaks)
+{
+	Scratch s;
+	int i, n, nbreaks;
+
+	hyph_initscratch(&s);
+	nbreaks = 0;
+	i = 0;
+	while (i < len) {
+		if (!hyph_isletter(ht, text[i])) {
+			i ++;
+			continue;
+		}
+		for (n = 0; i + n < len && hyph_isletter(ht, text[i+n]); n++) {
+			hyph_reserve(&s, n + 3);
+			s.runes[n] = hyph_fold(text[i+n]);
+			s.offs[n] = i + n;
+		}
+		nbreaks = hyph_breakword(ht, c, &s, n, breaks, nbreaks, maxbreaks);
+		i += n;
+	}
+	hyph_freescratch(&s);
+	return nbreaks;
+}
+
+static int
+hyph_scantext(HyphTrie *ht, HyphCache *c, char *text, int len, int *breaks, int maxbreaks)
+{
+	Scratch s;
+	Rune r;
+	int i, k, n, nbreaks;
+
+	hyph_initscratch(&s);
+	nbreaks = 0;
+	n = 0;
+	i = 0;
+	while (i <= len) {
+		if (i == len) {
+			r = 0;
+			k = 1;
+		} else if ((unsigned char)text[i] < Runeself) {
+			r = (unsigned char)text[i];
+			k = 1;
+		} else if (fullrune(text + i, len - i)) {
+			k = chartorune(&r, text + i);
+		} else {
+			r = Runeerror;
+			k = 1;
+		}
+
+		if (i < len && hyph_isletter(ht, r)) {
+			hyph_reserve(&s, n + 3);
+			s.runes[n] = hyph_fold(r);
+			s.offs[n] = i;
+			n ++;
+		} else if (n) {
+			nbreaks = hyph_breakword(ht, c, &s, n, breaks, nbreaks, maxbreaks);
+			n = 0;
+		}
+		i += k;
+	}
+	hyph_freescratch(&s);
+	return nbreaks;
+}
+
+/*
+ * hyph_runes: Find the break points in len runes of text and store their
+ * offsets in breaks, up to maxbreaks of them. Return how many there are,
+ * which may be more than maxbreaks.
+ */
+int
+hyph_runes(HyphTrie *ht, Rune *text, int len, int *breaks, int maxbreaks)
+{
+	return hyph_scanrunes(ht, NULL, text, len, breaks, maxbreaks);
+}
+
+/*
+ * hyph_text: Like hyph_runes, for len bytes of UTF-8; the offsets are in bytes.
+ */
+int
+hyph_text(HyphTrie *ht, char *text, int len, int *breaks, int maxbreaks)
+{
+	return hyph_scantext(ht, NULL, text, len, breaks, maxbreaks);
+}
+
+/* The same, going through a cache and its exceptions. */
+int
+hyph_cacherunes(HyphCache *c, Rune *text, int len, int *breaks, int maxbreaks)
+{
+	return hyph_scanrunes(c->ht, c, text, len, breaks, maxbreaks);
+}
+
+int
+hyph_cachetext(HyphCache *c, char *text, int len, int *breaks, int maxbreaks)
+{
+	return hyph_scantext(c->ht, c, text, len, breaks, maxbreaks);
+}
@@ -1,4 +1,8 @@
 typedef struct TrieNode		TrieNode;
+typedef struct HyphSlot		HyphSlot;
+typedef struct HyphTrie		HyphTrie;
+typedef struct HyphCache	HyphCache;
+typedef struct HyphCacheStats	HyphCacheStats;
 
 struct TrieNode
 {
@@ -9,8 +13,79 @@ struct TrieNode
 	TrieNode	*next;
 };
 
+/*
+ * Packed trie. The arc for character class c out of a node with base b
+ * is slots[b+c], and it is there only if the slot's class is c. Every
+ * node has its own base, and leaves have base 0.
+ */
+struct HyphSlot
+{
+	unsigned int	base;	/* base of the node this arc leads to */
+	unsigned int	arc;	/* offset in vals << 8 | class */
+};
+
+#define HYPHCLASS(s)	((s)->arc & 0xff)
+#define HYPHVALS(s)	((s)->arc >> 8)
+
+struct HyphTrie
+{
+	int		size;		/* bytes in all */
+	int		nslots;
+	int		nclasses;
+	int		nbig;
+	int		nvals;
+	unsigned int	root;		/* base of the root node */
+	unsigned char	lowmap[256];	/* class of each rune below 256, 0 if unused */
+	Rune		*big;		/* sorted runes above 255, the last nbig classes */
+	HyphSlot	*slots;
+	unsigned char	*vals;		/* (position+1, value) pairs ending with 0 */
+	void		*map;		/* file mapping, if loaded by hyph_loadtrie */
+	long		maplen;
+};
+
+/*
+ * A cache belongs to one thread. Every word looked up is counted once
+ * under exceptions, hits or misses; words too long to cache are also
+ * counted as uncached.
+ */
+struct HyphCacheStats
+{
+	long		lookups;
+	long		hits;
+	long		misses;
+	long		exceptions;
+	long		uncached;
+	long		evictions;
+};
+
+/* the fewest letters kept before and after a break */
+enum { HYPHLEFTMIN = 2, HYPHRIGHTMIN = 2 };
+
 /* hyph.c */
 int hyph_makepattern(char *s, Rune *patstr, char *patval);
 void hyph_integratepattern(TrieNode *trie, Rune *patstr, char *patval, int patlen, int idx);
 void hyph_hyphenate(TrieNode *trie, Rune *s, char *v, int len);
 void hyph_freetrie(TrieNode *trie);
+
+HyphTrie *hyph_compiletrie(TrieNode *trie);
+void hyph_freecompiled(HyphTrie *ht);
+void hyph_patternvalues(HyphTrie *ht, Rune *word, char *vals, int len);
+
+TrieNode *hyph_readpatterns(char *filename);
+int hyph_savetrie(HyphTrie *ht, char *filename);
+HyphTrie *hyph_loadtrie(char *filename);
+
+int hyph_word(HyphTrie *ht, Rune *word, int len, char *vals);
+int hyph_runes(HyphTrie *ht, Rune *text, int len, int *breaks, int maxbreaks);
+int hyph_text(HyphTrie *ht, char *text, int len, int *breaks, int maxbreaks);
+
+HyphCache *hyph_newcache(HyphTrie *ht, int nentries);
+void hyph_freecache(HyphCache *c);
+int hyph_addexceptions(HyphCache *c, char *text);
+int hyph_cacherunes(HyphCache *c, Rune *text, int len, int *breaks, int maxbreaks);
+int hyph_cachetext(HyphCache *c, char *text, int len, int *breaks, int maxbreaks);
+void hyph_cachestats(HyphCache *c, HyphCacheStats *stats);
+
+/* hyphthread.c */
+int hyph_threadtext(HyphTrie *ht, char *exceptions, char *text, int len,
+	int nthreads, int **breaks, HyphCacheStats *stats);
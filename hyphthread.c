@@ -0,0 +1,152 @@
+/*
+ * Hyphenate a large text on several threads.
+ *
+ * The text is cut into chunks at white space, and the workers take
+ * chunks off a shared counter. They all read the same packed trie,
+ * which is never written, and each has a cache of its own. Each chunk
+ * keeps its own breaks, which are joined in text order at the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utf.h"
+#include "hyph.h"
+
+enum { CHUNK = 64 << 10, CACHESIZE = 8192 };
+
+typedef struct Job		Job;
+typedef struct Pool		Pool;
+
+struct Job
+{
+	int		start, len;
+	int		*breaks;
+	int		nbreaks;
+};
+
+struct Pool
+{
+	HyphTrie	*ht;
+	char		*exceptions;
+	char		*text;
+	Job		*jobs;
+	int		njobs;
+	int		next;
+	pthread_mutex_t	lock;
+	HyphCacheStats	stats;
+};
+
+static void *
+worker(void *arg)
+{
+	Pool *pool = arg;
+	HyphCache *cache;
+	HyphCacheStats st;
+	Job *job;
+	int i;
+
+	cache = hyph_newcache(pool->ht, CACHESIZE);
+	if (pool->exceptions)
+		hyph_addexceptions(cache, pool->exceptions);
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->njobs)
+			break;
+
+		job = &pool->jobs[i];
+		/* there are never more breaks than bytes, so one pass does */
+		job->breaks = malloc((job->len + 1) * sizeof (int));
+		job->nbreaks = hyph_cachetext(cache, pool->text + job->start, job->len, job->breaks, job->len + 1);
+	}
+
+	hyph_cachestats(cache, &st);
+	hyph_freecache(cache);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stats.lookups += st.lookups;
+	pool->stats.hits += st.hits;
+	pool->stats.misses += st.misses;
+	pool->stats.exceptions += st.exceptions;
+	pool->stats.uncached += st.uncached;
+	pool->stats.evictions += st.evictions;
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static int
+isgap(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * hyph_threadtext: Like hyph_cachetext for len bytes of UTF-8, on nthreads
+ * threads (0 for one per processor), with the exceptions if not NULL.
+ * The byte offsets of all breaks are returned in order in *breaks, which
+ * the caller frees. If stats is not NULL it gets the sum over the caches.
+ */
+int
+hyph_threadtext(HyphTrie *ht, char *exceptions, char *text, int len,
+	int nthreads, int **breaks, HyphCacheStats *stats)
+{
+	pthread_t *tids;
+	Pool pool;
+	int i, k, n, end, start;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	memset(&pool, 0, sizeof pool);
+	pool.ht = ht;
+	pool.exceptions = exceptions;
+	pool.text = text;
+	pool.jobs = malloc((len / CHUNK + 1) * sizeof (Job));
+	pthread_mutex_init(&pool.lock, NULL);
+
+	/* a chunk ends after white space, which never belongs to a word */
+	for (start = 0; start < len; start = end) {
+		end = start + CHUNK < len ? start + CHUNK : len;
+		while (end < len && !isgap((unsigned char)text[end-1]))
+			end ++;
+		pool.jobs[pool.njobs].start = start;
+		pool.jobs[pool.njobs].len = end - start;
+		pool.njobs ++;
+	}
+
+	if (nthreads > pool.njobs)
+		nthreads = pool.njobs > 0 ? pool.njobs : 1;
+	tids = malloc(nthreads * sizeof (pthread_t));
+	for (i = 1; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, worker, &pool);
+	worker(&pool);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+
+	n = 0;
+	for (i = 0; i < pool.njobs; i++)
+		n += pool.jobs[i].nbreaks;
+	*breaks = malloc((n + 1) * sizeof (int));
+	n = 0;
+	for (i = 0; i < pool.njobs; i++) {
+		for (k = 0; k < pool.jobs[i].nbreaks; k++)
+			(*breaks)[n++] = pool.jobs[i].start + pool.jobs[i].breaks[k];
+		free(pool.jobs[i].breaks);
+	}
+
+	if (stats)
+		*stats = pool.stats;
+
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.jobs);
+	free(tids);
+	return n;
+}
@@ -11,12 +11,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utf.h"
+
+/* cc -DPARA_TRACE to see what the breakers do, on stderr */
+#ifdef PARA_TRACE
+#define TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE(...)
+#endif
 
 enum { GLYPH, SPACE };
 enum { ATOM, MOLE };
 enum { AWHOLE=0, APRE=1, APOST=2 };
 
+#define MINWIDTH 50
+#define MAXWIDTH 75
+
 typedef struct {
     int type; /* GLYPH, SPACE */
     int code;
@@ -33,133 +48,299 @@ typedef struct {
 typedef struct {
     int type; /* ATOM, MOLE */
     atom_t a[3]; /* whole, pre, post */
-    // XXX penalty
+    int penalty; /* added cost of breaking here, as TeX's */
 
     int prev; /* previous break */
     int next; /* next break (set at end of formatting) */
-    int demerits; /* accumulated cost for breaking here */
+    double demerits; /* accumulated cost for breaking here */
 } item_t;
 
 /* ----------------------------------------------------------------------- */
 
-static int nquarks;
-static quark_t quark[20000];
-static int nitems;
-static item_t item[20000];
+/*
+ * Everything about one paragraph. The arrays grow as needed and are
+ * kept by para_reset, so a context can be reused for paragraph after
+ * paragraph without allocating, and each thread can have its own.
+ */
+typedef struct {
+    int nquarks, capquarks;
+    quark_t *quark;
+    int nitems, capitems;
+    item_t *item;
+
+    int idx, len; /* quarks of the atom being built */
+    float wid; /* and their width */
+    int fitted; /* item prev/demerits are from para_format3 */
+    long examined; /* lines the last breaker tried */
+
+    float width; /* of a line, MAXWIDTH unless set */
+    float (*measure)(void *arg, int left, int code);
+    void *measurearg;
+    int left; /* last code measured in this word, or 0 */
+    int (*hyphenate)(void *arg, Rune *word, int len, int *breaks, int maxbreaks);
+    void *hyphenatearg;
+    Rune *word; /* the word being added, decoded */
+    int capword;
+
+    /* results: break items, in order */
+    int *brkbest;
+    int nbrkbest;
+
+    /* work space for the breakers, one entry per item */
+    int capwork;
+    int *brkbuf;
+    int bestcost;
+    double *sumsw, *sumnw, *sumlw;
+    int *active;
+    int *mole, *qbrk, *qstart, *from;
+    double *sqbest;
+} para_ctx;
+
+para_ctx *para_new(void)
+{
+    para_ctx *ctx = calloc(1, sizeof(para_ctx));
+    ctx->width = MAXWIDTH;
+    return ctx;
+}
+
+void para_reset(para_ctx *ctx)
+{
+    ctx->nquarks = 0;
+    ctx->nitems = 0;
+    ctx->idx = 0;
+    ctx->len = 0;
+    ctx->wid = 0;
+    ctx->nbrkbest = 0;
+    ctx->fitted = 0;
+}
+
+void para_free(para_ctx *ctx)
+{
+    free(ctx->quark);
+    free(ctx->item);
+    free(ctx->word);
+    free(ctx->brkbest);
+    free(ctx->brkbuf);
+    free(ctx->sumsw);
+    free(ctx->sumnw);
+    free(ctx->sumlw);
+    free(ctx->active);
+    free(ctx->mole);
+    free(ctx->qbrk);
+    free(ctx->qstart);
+    free(ctx->from);
+    free(ctx->sqbest);
+    free(ctx);
+}
+
+static void *para_grow(void *p, int *cap, int need, int size)
+{
+    if (need <= *cap)
+        return p;
+    while (*cap < need)
+        *cap = *cap ? *cap * 2 : 256;
+    return realloc(p, (size_t)*cap * size);
+}
+
+void para_set_width(para_ctx *ctx, float width)
+{
+    ctx->width = width;
+}
+
+/*
+ * Measure glyphs with measure(arg, left, code): the advance of rune code
+ * after left, kerning included, as glfont.c's measure_string finds it
+ * with FT_Get_Kerning and FT_Get_Advance. left is 0 at the start of a
+ * word. Without one every glyph is 1 wide.
+ */
+void para_set_measure(para_ctx *ctx, float (*measure)(void *, int, int), void *arg)
+{
+    ctx->measure = measure;
+    ctx->measurearg = arg;
+}
+
+/*
+ * Let parse break words where hyphenate(arg, word, len, breaks, max)
+ * says, as rune offsets in the word, in the way hyph_runes reports.
+ */
+void para_set_hyphenate(para_ctx *ctx, int (*hyphenate)(void *, Rune *, int, int *, int), void *arg)
+{
+    ctx->hyphenate = hyphenate;
+    ctx->hyphenatearg = arg;
+}
+
+/* make room for the item being built and the sentinel after it */
+static void para_room(para_ctx *ctx)
+{
+    ctx->item = para_grow(ctx->item, &ctx->capitems, ctx->nitems + 2, sizeof(item_t));
+}
+
+/* size the work space for the items there are now */
+static void para_work(para_ctx *ctx)
+{
+    int cap, need = ctx->nitems + 2;
+
+    ctx->examined = 0;
+    if (need <= ctx->capwork)
+        return;
+    cap = ctx->capwork;
+    ctx->brkbest = para_grow(ctx->brkbest, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->brkbuf = para_grow(ctx->brkbuf, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->sumsw = para_grow(ctx->sumsw, &cap, need, sizeof(double));
+    cap = ctx->capwork;
+    ctx->sumnw = para_grow(ctx->sumnw, &cap, need, sizeof(double));
+    cap = ctx->capwork;
+    ctx->sumlw = para_grow(ctx->sumlw, &cap, need, sizeof(double));
+    cap = ctx->capwork;
+    ctx->active = para_grow(ctx->active, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->mole = para_grow(ctx->mole, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->qbrk = para_grow(ctx->qbrk, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->qstart = para_grow(ctx->qstart, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->from = para_grow(ctx->from, &cap, need, sizeof(int));
+    cap = ctx->capwork;
+    ctx->sqbest = para_grow(ctx->sqbest, &cap, need, sizeof(double));
+    ctx->capwork = cap;
+}
 
-static int idx = 0;
-static int len = 0;
+void para_add_quark(para_ctx *ctx, int t, int c, float w)
+{
+    ctx->quark = para_grow(ctx->quark, &ctx->capquarks, ctx->nquarks + 1, sizeof(quark_t));
+    ctx->quark[ctx->nquarks].type = t;
+    ctx->quark[ctx->nquarks].code = c;
+    ctx->quark[ctx->nquarks].width = w;
+    ctx->nquarks++;
+    ctx->len++;
+    ctx->wid += w;
+}
 
-void para_add_quark(int t, int c, float w)
+static float para_measure(para_ctx *ctx, int c)
 {
-    quark[nquarks].type = t;
-    quark[nquarks].code = c;
-    quark[nquarks].width = w;
-    nquarks++;
-    len++;
+    float w = 1;
+
+    if (ctx->measure)
+        w = ctx->measure(ctx->measurearg, ctx->left, c);
+    ctx->left = c;
+    return w;
 }
 
-void para_add_atom(int i)
+void para_add_atom(para_ctx *ctx, int i)
 {
-    item[nitems].a[i].idx = idx;
-    item[nitems].a[i].len = len;
+    para_room(ctx);
+    ctx->item[ctx->nitems].a[i].idx = ctx->idx;
+    ctx->item[ctx->nitems].a[i].len = ctx->len;
 
-    item[nitems].a[i].sw = len;
-    item[nitems].a[i].nw = len;
-    item[nitems].a[i].lw = len;
+    ctx->item[ctx->nitems].a[i].sw = ctx->wid;
+    ctx->item[ctx->nitems].a[i].nw = ctx->wid;
+    ctx->item[ctx->nitems].a[i].lw = ctx->wid;
 
-    idx = nquarks;
-    len = 0;
+    ctx->idx = ctx->nquarks;
+    ctx->len = 0;
+    ctx->wid = 0;
 }
 
-void para_add_item(int t)
+void para_add_item(para_ctx *ctx, int t)
 {
-    item[nitems].type = t;
-    nitems++;
+    para_room(ctx);
+    ctx->item[ctx->nitems].type = t;
+    ctx->item[ctx->nitems].penalty = 0;
+    ctx->nitems++;
 }
 
-void para_add_sentinel(void)
+/* make breaking at the last item added cost more, or less if negative */
+void para_set_penalty(para_ctx *ctx, int penalty)
 {
-    item[nitems].type = MOLE;
+    ctx->item[ctx->nitems-1].penalty = penalty;
 }
 
-void para_add_root(void)
+/* let the last atom added shrink and stretch, as spaces do */
+void para_set_glue(para_ctx *ctx, int i, float shrink, float stretch)
+{
+    ctx->item[ctx->nitems].a[i].sw -= shrink;
+    ctx->item[ctx->nitems].a[i].lw += stretch;
+}
+
+void para_add_sentinel(para_ctx *ctx)
 {
     int i;
+    para_room(ctx);
     for (i=0; i < 3; i++) {
-        item[nitems].a[i].idx = 0;
-        item[nitems].a[i].len = 0;
-        item[nitems].a[i].sw = 0;
-        item[nitems].a[i].nw = 0;
-        item[nitems].a[i].lw = 0;
+        ctx->item[ctx->nitems].a[i].idx = 0;
+        ctx->item[ctx->nitems].a[i].len = 0;
+        ctx->item[ctx->nitems].a[i].sw = 0;
+        ctx->item[ctx->nitems].a[i].nw = 0;
+        ctx->item[ctx->nitems].a[i].lw = 0;
     }
-    item[nitems].type = MOLE;
-    nitems++;
+    ctx->item[ctx->nitems].type = MOLE;
+    ctx->item[ctx->nitems].penalty = 0;
 }
 
-/* ----------------------------------------------------------------------- */
-
-#define MINWIDTH 50
-#define MAXWIDTH 75
+void para_add_root(para_ctx *ctx)
+{
+    para_add_sentinel(ctx);
+    ctx->nitems++;
+}
 
-static int brkbuf[10000];
-static int brkbest[10000];
-static int nbrkbest;
-static int bestcost;
+/* ----------------------------------------------------------------------- */
 
 int para_cost(int start, int end, float sw, int depth)
 {
     return depth * 10 + (MAXWIDTH-sw)*(MAXWIDTH-sw)*30;
 }
 
-void para_format(int start, int accum, int depth)
+void para_format(para_ctx *ctx, int start, int accum, int depth)
 {
     float sw, lw;
     int cost;
     int i, k;
 
-    for (i=0; i < depth; i++) putchar(' ');
-    printf("fmt: %d %d %d\n", start, accum, depth);
+    TRACE("%*sfmt: %d %d %d\n", depth, "", start, accum, depth);
 
     /* at least one word per line... */
     i = start + 1;
-    sw = item[start].a[0].sw;
-    lw = item[start].a[0].lw;
+    sw = ctx->item[start].a[0].sw;
+    lw = ctx->item[start].a[0].lw;
 
     /* explore all potential breaks */
-    while (sw <= MAXWIDTH && i < nitems)
+    while (sw <= MAXWIDTH && i < ctx->nitems)
     {
         /* potential break... explore */
-        if (item[i].type == MOLE && lw >= MINWIDTH)
+        if (ctx->item[i].type == MOLE && lw >= MINWIDTH)
         {
-            brkbuf[depth] = i;
+            ctx->examined++;
+            ctx->brkbuf[depth] = i;
             cost = accum + para_cost(start, i, sw, depth);
 
             /* not worth trying if already past bestcost */
-            if (cost < bestcost) {
-                para_format(i, cost, depth+1);
+            if (cost < ctx->bestcost) {
+                para_format(ctx, i, cost, depth+1);
             }
         }
 
         /* ... or don't */
-        sw += item[i].a[AWHOLE].sw;
-        lw += item[i].a[AWHOLE].lw;
+        sw += ctx->item[i].a[AWHOLE].sw;
+        lw += ctx->item[i].a[AWHOLE].lw;
         i++;
     }
 
     /* hit end... keep if better than the best */
-    if (i == nitems)
+    if (i == ctx->nitems)
     {
-        printf("hit end with cost: %d ... %d\n", accum, bestcost);
-        if (accum < bestcost) {
-            printf("better sequence: %d\n", accum);
-            bestcost = accum;
+        TRACE("hit end with cost: %d ... %d\n", accum, ctx->bestcost);
+        if (accum < ctx->bestcost) {
+            TRACE("better sequence: %d\n", accum);
+            ctx->bestcost = accum;
             for (k=0; k < depth; k++) {
-                brkbest[k] = brkbuf[k];
-                printf("%d ", brkbest[k]);
+                ctx->brkbest[k] = ctx->brkbuf[k];
+                TRACE("%d ", ctx->brkbest[k]);
             }
-            printf("\n");
-            nbrkbest = depth;
+            TRACE("\n");
+            ctx->nbrkbest = depth;
             //pretty();
         }
         return;
@@ -168,24 +349,26 @@ void para_format(int start, int accum, int depth)
 
 /* ----------------------------------------------------------------------- */
 
-void para_format2(void)
+void para_format2(para_ctx *ctx)
 {
     int cur, child, first, demerits;
     float wid;
 
-    for (cur=0; cur < nitems+1 ; cur++) {
-        item[cur].demerits = 0;
-        item[cur].prev = -1;
-        item[cur].next = -1;
+    para_work(ctx);
+    ctx->fitted = 0;
+    for (cur=0; cur < ctx->nitems+1 ; cur++) {
+        ctx->item[cur].demerits = 0;
+        ctx->item[cur].prev = -1;
+        ctx->item[cur].next = -1;
     }
 
     /* consider all possible breaks */
-    for (cur = 0 ; cur < nitems ; cur++)
+    for (cur = 0 ; cur < ctx->nitems ; cur++)
     {
-        printf("fmt2: %d/%d\n", cur, nitems);
+        TRACE("fmt2: %d/%d\n", cur, ctx->nitems);
 
         /* skip unbreakables */
-        if (item[cur].type == ATOM) {
+        if (ctx->item[cur].type == ATOM) {
             continue;
         }
 
@@ -194,130 +377,752 @@ void para_format2(void)
         wid = 0; /* cur[APOST] */
 
         /* keep going until it is too long */
-        while (wid < MAXWIDTH && child <= nitems)
+        while (wid < MAXWIDTH && child <= ctx->nitems)
         {
             /* no more items */
-            if (child == nitems) {
-                demerits = item[cur].demerits;
+            if (child == ctx->nitems) {
+                demerits = ctx->item[cur].demerits;
                 demerits += 10;
-                printf("  drop = %d\n", demerits);
+                TRACE("  drop = %d\n", demerits);
             }
 
             /* potential break: save demerits if broken here */
-            else if (item[child].type == MOLE) {
-                demerits = item[cur].demerits;
+            else if (ctx->item[child].type == MOLE) {
+                demerits = ctx->item[cur].demerits;
                 //demerits += (MAXWIDTH - wid) * (MAXWIDTH - wid) * 30;
                 demerits += 10; /* Line penalty */
-                printf("  child[%d] = %d\n", child, demerits);
+                TRACE("  child[%d] = %d\n", child, demerits);
             }
 
             /* potential break (sentinel or mole) */
-            if (child == nitems || item[child].type == MOLE)
+            if (child == ctx->nitems || ctx->item[child].type == MOLE)
             {
+                ctx->examined++;
+
                 /* check if we have a better path to get to child */
-                if (item[child].prev == -1 || demerits < item[child].demerits)
+                if (ctx->item[child].prev == -1 || demerits < ctx->item[child].demerits)
                 {
-                    printf("  -> saved[%d].prev = %d\n", child, cur);
-                    item[child].prev = cur;
-                    item[child].demerits = demerits;
+                    TRACE("  -> saved[%d].prev = %d\n", child, cur);
+                    ctx->item[child].prev = cur;
+                    ctx->item[child].demerits = demerits;
                 }
             }
 
             /* keep track of widths */
-            wid += item[child].a[0].sw;
+            wid += ctx->item[child].a[0].sw;
 
             /* move to next potential item */
             child ++;
         }
     }
 
-    printf("---\n");
-    for (cur=0; cur < nitems; cur++) {
-        if (item[cur].type == MOLE) {
-            printf("item[%d] prev=%d demerits=%d\n",
-                   cur, item[cur].prev, item[cur].demerits);
+#ifdef PARA_TRACE
+    TRACE("---\n");
+    for (cur=0; cur < ctx->nitems; cur++) {
+        if (ctx->item[cur].type == MOLE) {
+            TRACE("item[%d] prev=%d demerits=%g\n",
+                  cur, ctx->item[cur].prev, ctx->item[cur].demerits);
         }
     }
-    printf("---\n");
+    TRACE("---\n");
+#endif
 
-    printf("recovering...\n");
+    TRACE("recovering...\n");
 
     /* recover best path */
-    for (cur = nitems; cur != -1; cur = item[cur].prev) {
-        printf("cur=%d prev=%d\n", cur, item[cur].prev);
-        if (item[cur].prev == -1) {
+    for (cur = ctx->nitems; cur != -1; cur = ctx->item[cur].prev) {
+        TRACE("cur=%d prev=%d\n", cur, ctx->item[cur].prev);
+        if (ctx->item[cur].prev == -1) {
             first = cur;
         }
         else {
-            item[item[cur].prev].next = cur;
+            ctx->item[ctx->item[cur].prev].next = cur;
         }
     }
 
-    printf("storing...\n");
+    TRACE("storing...\n");
 
     /* and store it */
-    nbrkbest = 0;
-    for (cur = first ; cur != -1 ; cur = item[cur].next) {
-        brkbest[nbrkbest++] = cur;
-        printf("%d: %d\n", nbrkbest-1, cur);
+    ctx->nbrkbest = 0;
+    for (cur = first ; cur != -1 ; cur = ctx->item[cur].next) {
+        ctx->brkbest[ctx->nbrkbest++] = cur;
+        TRACE("%d: %d\n", ctx->nbrkbest-1, cur);
     }
 }
 
 /* ----------------------------------------------------------------------- */
 
-void parse(char *s)
+/*
+ * Total fit after Knuth and Plass.
+ *
+ * Every mole that can still end a line starting after it is active.
+ * For each new mole the lines from all active moles are measured with
+ * prefix sums of the short/ideal/long widths, and it keeps the one with
+ * the least total demerits. An active mole whose line can no longer
+ * shrink to fit is dropped for good, so the active list stays about one
+ * line long and the whole pass is near linear.
+ */
+
+#define LINEPENALTY 10
+#define TOLERANCE 1000
+#define INFBAD 10000
+#define HYPHENPENALTY 50
+#define DOUBLEHYPHEN 10000
+
+/*
+ * Widths are added up in units of 1/65536, which doubles hold exactly,
+ * so a line measures the same wherever it is in the paragraph. With
+ * float sums its width would round differently after an edit moved it.
+ */
+static double para_exact(float w)
+{
+    return (double)(long long)(w * 65536.0 + (w < 0 ? -0.5 : 0.5)) / 65536.0;
+}
+
+/* prefix sums of the item widths, from item i on */
+static void para_sums(para_ctx *ctx, int i)
 {
-    char *w = strtok(s, " ");
-    while (w != NULL) {
-        while (*w != '\0') {
-            para_add_quark(GLYPH, *w, 1);
-            w++;
+    ctx->sumsw[0] = ctx->sumnw[0] = ctx->sumlw[0] = 0;
+    for (; i < ctx->nitems; i++) {
+        ctx->sumsw[i+1] = ctx->sumsw[i] + para_exact(ctx->item[i].a[AWHOLE].sw);
+        ctx->sumnw[i+1] = ctx->sumnw[i] + para_exact(ctx->item[i].a[AWHOLE].nw);
+        ctx->sumlw[i+1] = ctx->sumlw[i] + para_exact(ctx->item[i].a[AWHOLE].lw);
+    }
+}
+
+/* widths of the line after a break at b up to a break at e */
+static void para_line(para_ctx *ctx, int b, int e, float *sw, float *nw, float *lw)
+{
+    atom_t *post = &ctx->item[b].a[APOST];
+    atom_t *pre = &ctx->item[e].a[APRE];
+
+    *sw = ctx->sumsw[e] - ctx->sumsw[b+1] + post->sw + pre->sw;
+    *nw = ctx->sumnw[e] - ctx->sumnw[b+1] + post->nw + pre->nw;
+    *lw = ctx->sumlw[e] - ctx->sumlw[b+1] + post->lw + pre->lw;
+}
+
+/* TeX's badness: 100 times the cube of the adjustment ratio */
+static int para_badness(para_ctx *ctx, float sw, float nw, float lw, int last)
+{
+    float r;
+
+    if (nw < ctx->width) {
+        if (last)
+            return 0; /* the last line is filled out */
+        if (lw <= nw)
+            return INFBAD;
+        r = (ctx->width - nw) / (lw - nw);
+    }
+    else if (nw > ctx->width) {
+        if (sw > ctx->width)
+            return INFBAD + 1; /* overfull */
+        r = (nw - ctx->width) / (nw - sw);
+    }
+    else {
+        return 0;
+    }
+
+    if (r > 10)
+        return INFBAD;
+    r = 100 * r * r * r;
+    return r > INFBAD ? INFBAD : r;
+}
+
+/* a break that leaves something at the end of its line: a hyphen */
+static int para_flagged(para_ctx *ctx, int i)
+{
+    return ctx->item[i].a[APRE].len > 0;
+}
+
+/* TeX's demerits for a line from b to e with the given badness */
+static double para_demerits(para_ctx *ctx, int b, int e, int bad)
+{
+    double d, p;
+
+    d = (double)(LINEPENALTY + bad) * (LINEPENALTY + bad);
+    p = ctx->item[e].penalty;
+    if (p > 0)
+        d += p * p;
+    else if (p < 0)
+        d -= p * p;
+    if (para_flagged(ctx, b) && para_flagged(ctx, e))
+        d += DOUBLEHYPHEN;
+    return d;
+}
+
+/* link the best path back from the sentinel into brkbest */
+static void para_store(para_ctx *ctx)
+{
+    int cur, first;
+
+    first = 0;
+    for (cur = ctx->nitems; cur != -1; cur = ctx->item[cur].prev) {
+        if (ctx->item[cur].prev == -1)
+            first = cur;
+        else
+            ctx->item[ctx->item[cur].prev].next = cur;
+    }
+
+    ctx->nbrkbest = 0;
+    for (cur = first; cur != -1; cur = ctx->item[cur].next)
+        ctx->brkbest[ctx->nbrkbest++] = cur;
+}
+
+/* find the best line ending at mole e from the active moles */
+static void para_fit(para_ctx *ctx, int e, int *nactive)
+{
+    int i, k, b, last, bad, bestprev, rescue;
+    float sw, nw, lw;
+    double d, best;
+
+    last = (e == ctx->nitems);
+    bestprev = -1;
+    best = 0;
+    rescue = -1;
+
+    k = 0;
+    for (i = 0; i < *nactive; i++)
+    {
+        b = ctx->active[i];
+        para_line(ctx, b, e, &sw, &nw, &lw);
+        ctx->examined++;
+
+        /* too long now, and only gets longer */
+        if (sw > ctx->width) {
+            if (rescue == -1 || ctx->item[b].demerits < ctx->item[rescue].demerits)
+                rescue = b;
+            continue;
         }
-        para_add_atom(AWHOLE);
-        para_add_item(ATOM);
+        ctx->active[k++] = b;
+
+        bad = para_badness(ctx, sw, nw, lw, last);
+        if (bad > TOLERANCE)
+            continue;
 
-        para_add_quark(SPACE, ' ', 1);
-        para_add_atom(AWHOLE);
-        para_add_atom(APRE);
-        para_add_atom(APOST);
-        para_add_item(MOLE);
+        d = ctx->item[b].demerits + para_demerits(ctx, b, e, bad);
+        if (bestprev == -1 || d < best) {
+            best = d;
+            bestprev = b;
+        }
+    }
+    *nactive = k;
 
-        w = strtok(NULL, " ");
+    /* nothing fits: set an overfull line rather than give up */
+    if (bestprev == -1 && *nactive == 0 && rescue != -1) {
+        bestprev = rescue;
+        best = ctx->item[rescue].demerits + para_demerits(ctx, rescue, e, INFBAD);
     }
 
-    nitems--;
+    if (bestprev != -1) {
+        TRACE("fit: %d -> %d demerits %g\n", bestprev, e, best);
+        ctx->item[e].prev = bestprev;
+        ctx->item[e].demerits = best;
+        ctx->active[(*nactive)++] = e;
+    }
+}
+
+void para_format3(para_ctx *ctx)
+{
+    int nactive, i, e;
+
+    para_work(ctx);
+    para_sums(ctx, 0);
+    for (i = 0; i < ctx->nitems+1; i++) {
+        ctx->item[i].demerits = 0;
+        ctx->item[i].prev = -1;
+        ctx->item[i].next = -1;
+    }
+
+    nactive = 0;
+    ctx->active[nactive++] = 0;
+
+    for (e = 1; e <= ctx->nitems; e++)
+        if (e == ctx->nitems || ctx->item[e].type == MOLE)
+            para_fit(ctx, e, &nactive);
+
+    para_store(ctx);
+    ctx->fitted = 1;
+}
+
+/*
+ * When the cost of a line is only a convex function of its natural
+ * width, such as the squared slack, it has the Monge property and the
+ * best previous break moves right monotonically. Then a queue of
+ * candidate breaks, each owning a range of later moles, finds all
+ * the best breaks in O(n log n) without any active list. A penalty
+ * only depends on where the line ends and keeps that, but the extra
+ * demerits for two hyphens in a row do not, so they are left out.
+ */
+
+#define OVERFULL 1e6
+
+static double para_sqpenalty(para_ctx *ctx, int k)
+{
+    double p = ctx->item[ctx->mole[k]].penalty;
+    return p < 0 ? -p * p : p * p;
+}
+
+static double para_sqcost(para_ctx *ctx, int j, int k)
+{
+    float sw, nw, lw;
+    double slack;
+
+    para_line(ctx, ctx->mole[j], ctx->mole[k], &sw, &nw, &lw);
+    ctx->examined++;
+    slack = ctx->width - nw;
+    if (slack < 0)
+        return ctx->sqbest[j] + LINEPENALTY + para_sqpenalty(ctx, k) + OVERFULL * -slack;
+    return ctx->sqbest[j] + LINEPENALTY + para_sqpenalty(ctx, k) + slack * slack;
+}
+
+void para_format_sq(para_ctx *ctx)
+{
+    int nm, head, tail, i, j, k, lo, hi, mid, s;
+    float sw, nw, lw;
+    double c;
+
+    para_work(ctx);
+    ctx->fitted = 0;
+    para_sums(ctx, 0);
+    for (i = 0; i < ctx->nitems+1; i++) {
+        ctx->item[i].demerits = 0;
+        ctx->item[i].prev = -1;
+        ctx->item[i].next = -1;
+    }
+
+    nm = 0;
+    for (i = 0; i < ctx->nitems; i++)
+        if (ctx->item[i].type == MOLE)
+            ctx->mole[nm++] = i;
+    ctx->mole[nm++] = ctx->nitems;
+
+    ctx->sqbest[0] = 0;
+    head = tail = 0;
+    ctx->qbrk[tail] = 0;
+    ctx->qstart[tail] = 1;
+    tail++;
+
+    for (k = 1; k < nm - 1; k++)
+    {
+        while (tail - head > 1 && ctx->qstart[head+1] <= k)
+            head++;
+        j = ctx->qbrk[head];
+        ctx->sqbest[k] = para_sqcost(ctx, j, k);
+        ctx->from[k] = j;
+
+        /* k takes over the tail of the range of any candidate it beats */
+        while (tail > head) {
+            s = ctx->qstart[tail-1] > k + 1 ? ctx->qstart[tail-1] : k + 1;
+            if (para_sqcost(ctx, k, s) <= para_sqcost(ctx, ctx->qbrk[tail-1], s))
+                tail--;
+            else
+                break;
+        }
+        if (tail == head) {
+            ctx->qbrk[tail] = k;
+            ctx->qstart[tail] = k + 1;
+            tail++;
+        }
+        else {
+            lo = (ctx->qstart[tail-1] > k + 1 ? ctx->qstart[tail-1] : k + 1) + 1;
+            hi = nm - 1;
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (para_sqcost(ctx, k, mid) <= para_sqcost(ctx, ctx->qbrk[tail-1], mid))
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            if (lo < nm - 1) {
+                ctx->qbrk[tail] = k;
+                ctx->qstart[tail] = lo;
+                tail++;
+            }
+        }
+    }
+
+    /* the last line costs nothing if it fits, which is not convex; scan */
+    k = nm - 1;
+    ctx->sqbest[k] = -1;
+    for (j = 0; j < k; j++) {
+        para_line(ctx, ctx->mole[j], ctx->mole[k], &sw, &nw, &lw);
+        ctx->examined++;
+        c = ctx->sqbest[j] + LINEPENALTY + (nw > ctx->width ? OVERFULL * (nw - ctx->width) : 0);
+        if (ctx->sqbest[k] < 0 || c < ctx->sqbest[k]) {
+            ctx->sqbest[k] = c;
+            ctx->from[k] = j;
+        }
+    }
+
+    for (k = nm - 1; k > 0; k = ctx->from[k]) {
+        ctx->item[ctx->mole[k]].prev = ctx->mole[ctx->from[k]];
+        ctx->item[ctx->mole[k]].demerits = ctx->sqbest[k];
+    }
+
+    para_store(ctx);
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* a hyphen that is only there if the line breaks after it */
+static void para_add_hyphen(para_ctx *ctx)
+{
+    para_add_atom(ctx, AWHOLE);
+    para_add_quark(ctx, GLYPH, '-', para_measure(ctx, '-'));
+    para_add_atom(ctx, APRE);
+    para_add_atom(ctx, APOST);
+    para_add_item(ctx, MOLE);
+    para_set_penalty(ctx, HYPHENPENALTY);
+}
+
+/* add each word of s and the space after it */
+static void para_words(para_ctx *ctx, char *s)
+{
+    int breaks[64];
+    int n, i, k, c, len;
+    float w;
+
+    while (*s != '\0') {
+        if (*s == ' ') {
+            s++;
+            continue;
+        }
+
+        /* glyphs and breaks count runes, not bytes */
+        len = 0;
+        while (*s != '\0' && *s != ' ') {
+            ctx->word = para_grow(ctx->word, &ctx->capword, len + 1, sizeof(Rune));
+            s += chartorune(&ctx->word[len++], s);
+        }
+
+        n = 0;
+        if (ctx->hyphenate)
+            n = ctx->hyphenate(ctx->hyphenatearg, ctx->word, len, breaks, 64);
+        if (n > 64)
+            n = 64; /* hyph_text counts the breaks it had no room for */
+
+        ctx->left = 0;
+        for (i = k = 0; i < len; i++) {
+            if (k < n && breaks[k] == i) {
+                if (i > 0) {
+                    c = ctx->left;
+                    para_add_atom(ctx, AWHOLE);
+                    para_add_item(ctx, ATOM);
+                    para_add_hyphen(ctx);
+                    ctx->left = c;
+                }
+                k++;
+            }
+            para_add_quark(ctx, GLYPH, ctx->word[i], para_measure(ctx, ctx->word[i]));
+        }
+        para_add_atom(ctx, AWHOLE);
+        para_add_item(ctx, ATOM);
+
+        ctx->left = 0;
+        w = para_measure(ctx, ' ');
+        para_add_quark(ctx, SPACE, ' ', w);
+        para_add_atom(ctx, AWHOLE);
+        para_set_glue(ctx, AWHOLE, w/3, w/2);
+        para_add_atom(ctx, APRE);
+        para_add_atom(ctx, APOST);
+        para_add_item(ctx, MOLE);
+    }
 }
 
-void print(void)
+void parse(para_ctx *ctx, char *s)
+{
+    para_words(ctx, s);
+
+    /* drop the space after the last word */
+    if (ctx->nitems > 1)
+        ctx->nitems--;
+}
+
+static void putrune(int c)
+{
+    char buf[UTFmax];
+    Rune r = c;
+
+    fwrite(buf, 1, runetochar(buf, &r), stdout);
+}
+
+void print(para_ctx *ctx)
 {
     int i, k;
-    for (i = 0 ; i < nitems ; i++) {
-        printf("mol[%d/%d]: ", i, item[i].type);
-        for (k = item[i].a[0].idx; k < item[i].a[0].idx+item[i].a[0].len; k++)
+    for (i = 0 ; i < ctx->nitems ; i++) {
+        printf("mol[%d/%d]: ", i, ctx->item[i].type);
+        for (k = ctx->item[i].a[0].idx; k < ctx->item[i].a[0].idx+ctx->item[i].a[0].len; k++)
         {
-            putchar(quark[k].code);
+            putrune(ctx->quark[k].code);
         }
         putchar('\n');
     }
 }
 
-void pretty(void)
+static void pretty_atom(para_ctx *ctx, atom_t *a)
+{
+    int k;
+    for (k = a->idx; k < a->idx + a->len; k++)
+        putrune(ctx->quark[k].code);
+}
+
+void pretty(para_ctx *ctx)
 {
-    int i, k, l;
+    int i, l;
     l = 0;
-    for (i = 0 ; i < nitems ; i++) {
-        for (k = item[i].a[0].idx; k < item[i].a[0].idx+item[i].a[0].len; k++)
-        {
-            putchar(quark[k].code);
-        }
-        if (brkbest[l] == i && l < nbrkbest) {
+    for (i = 0 ; i < ctx->nitems ; i++) {
+        if (l < ctx->nbrkbest && ctx->brkbest[l] == i) {
+            pretty_atom(ctx, &ctx->item[i].a[APRE]);
             putchar('\n');
+            pretty_atom(ctx, &ctx->item[i].a[APOST]);
             l++;
         }
+        else {
+            pretty_atom(ctx, &ctx->item[i].a[AWHOLE]);
+        }
     }
     putchar('\n');
 }
 
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Editing. A line ending at a mole only depends on the moles still
+ * active there, about one line back, so after an edit only the moles
+ * from the edit on are fitted again, starting from the active list
+ * para_format3 had at that point. The demerits add up along a path,
+ * so after the edit they all move by the change in cost of the lines
+ * around it; once the moles that can still be reached all keep their
+ * old break and move by the same amount, every later one does too,
+ * and the fitting stops. This holds exactly, not just nearly: the
+ * widths are summed exactly, so a line after the edit measures what
+ * it did before, and demerits are whole numbers, so adding the same
+ * shift to them never changes which is least. Moving the items after
+ * the edit, summing their widths again and shifting their demerits is
+ * still linear, but cheap next to the fitting, which stays near the
+ * edit.
+ */
+
+/* fit again from item at on; items at..end-1 are new, the rest as before */
+static void para_refit(para_ctx *ctx, int at, int end)
+{
+    int nactive, e, b, emax, lastdiff, eprev, oldprev, shifted;
+    float sw, nw, lw;
+    double olddem, shift, top;
+
+    para_sums(ctx, at);
+
+    e = at;
+    while (e < ctx->nitems && ctx->item[e].type != MOLE)
+        e++;
+
+    /*
+     * The moles active at e: those a line to any mole before e could
+     * still reach. Widths are not negative, so once the items alone
+     * are too long nothing further back is active either.
+     */
+    nactive = 0;
+    emax = -1;
+    top = 0;
+    for (b = e - 1; b >= 0; b--) {
+        if (b + 1 < e && ctx->item[b+1].type == MOLE &&
+            (emax == -1 || ctx->sumsw[b+1] + ctx->item[b+1].a[APRE].sw > top)) {
+            emax = b + 1;
+            top = ctx->sumsw[b+1] + ctx->item[b+1].a[APRE].sw;
+        }
+        if (emax != -1 && top - ctx->sumsw[b+1] > ctx->width)
+            break;
+        if (ctx->item[b].type != MOLE || (b > 0 && ctx->item[b].prev == -1))
+            continue;
+        if (emax != -1) {
+            para_line(ctx, b, emax, &sw, &nw, &lw);
+            if (sw > ctx->width)
+                continue;
+        }
+        ctx->active[nactive++] = b;
+    }
+    for (b = 0; b < nactive / 2; b++) {
+        e = ctx->active[b];
+        ctx->active[b] = ctx->active[nactive-1-b];
+        ctx->active[nactive-1-b] = e;
+    }
+
+    /* lastdiff: the last mole not known to match the old fit, by shift */
+    lastdiff = end - 1;
+    eprev = -1;
+    shifted = 0;
+    shift = 0;
+    for (e = at; e <= ctx->nitems; e++)
+    {
+        if (e < ctx->nitems && ctx->item[e].type != MOLE)
+            continue;
+
+        /* converged: nothing that changed can reach this far */
+        if (e >= end && shifted && eprev > lastdiff &&
+            ctx->sumsw[eprev] - ctx->sumsw[lastdiff+1] > ctx->width)
+            break;
+
+        oldprev = ctx->item[e].prev;
+        olddem = ctx->item[e].demerits;
+        ctx->item[e].prev = -1;
+        ctx->item[e].demerits = 0;
+        para_fit(ctx, e, &nactive);
+
+        if (e < end || ctx->item[e].prev != oldprev) {
+            lastdiff = e;
+            shifted = 0;
+        }
+        else if (oldprev != -1 &&
+                 (!shifted || ctx->item[e].demerits - olddem != shift)) {
+            if (eprev > lastdiff)
+                lastdiff = eprev;
+            shift = ctx->item[e].demerits - olddem;
+            shifted = 1;
+        }
+        eprev = e;
+    }
+
+    /* the rest keep their breaks */
+    for (; e <= ctx->nitems; e++)
+        if (ctx->item[e].prev != -1)
+            ctx->item[e].demerits += shift;
+
+    para_store(ctx);
+}
+
+/*
+ * Replace items at..at+ndel-1 with the words of s, each with the
+ * space after it, and break the paragraph again. at is the item of
+ * a word; to add words at the end, at is nitems and the spaces go
+ * before the words instead.
+ */
+void para_edit(para_ctx *ctx, int at, int ndel, char *s)
+{
+    item_t sentinel, *tmp;
+    int n, m, i;
+
+    n = ctx->nitems;
+    sentinel = ctx->item[n];
+    para_words(ctx, s);
+    m = ctx->nitems - n;
+
+    tmp = malloc((m + 1) * sizeof(item_t));
+    if (at == n && m > 0) {
+        tmp[0] = ctx->item[n+m-1];
+        memcpy(tmp + 1, &ctx->item[n], (m - 1) * sizeof(item_t));
+    }
+    else {
+        memcpy(tmp, &ctx->item[n], m * sizeof(item_t));
+    }
+    ctx->item[n] = sentinel;
+    memmove(&ctx->item[at+m], &ctx->item[at+ndel], (n - at - ndel + 1) * sizeof(item_t));
+    memcpy(&ctx->item[at], tmp, m * sizeof(item_t));
+    free(tmp);
+    ctx->nitems = n - ndel + m;
+
+    for (i = at; i < at + m; i++) {
+        ctx->item[i].prev = -1;
+        ctx->item[i].next = -1;
+        ctx->item[i].demerits = 0;
+    }
+    for (; i <= ctx->nitems; i++) {
+        if (ctx->item[i].prev >= at + ndel)
+            ctx->item[i].prev += m - ndel;
+        else if (ctx->item[i].prev >= at)
+            ctx->item[i].prev = -2; /* broke at a deleted item */
+    }
+
+    if (!ctx->fitted || at < 1) {
+        para_format3(ctx);
+        return;
+    }
+    para_work(ctx);
+    para_refit(ctx, at, at + m);
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Whole documents. Paragraphs are independent, so worker threads
+ * take them one at a time off a shared counter, each with its own
+ * context, and leave the breaks in the job; the jobs stay in order.
+ */
+
+typedef struct {
+    char *text; /* in */
+    int *brk; /* out: break items, as in brkbest */
+    int nbrk;
+} para_job_t;
+
+typedef struct {
+    para_job_t *jobs;
+    int njobs;
+    int next;
+    pthread_mutex_t lock;
+} para_pool_t;
+
+static void *para_worker(void *arg)
+{
+    para_pool_t *pool = arg;
+    para_ctx *ctx = para_new();
+    para_job_t *job;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->njobs)
+            break;
+
+        job = &pool->jobs[i];
+        para_reset(ctx);
+        para_add_root(ctx);
+        parse(ctx, job->text);
+        para_add_sentinel(ctx);
+        para_format3(ctx);
+
+        job->nbrk = ctx->nbrkbest;
+        job->brk = malloc(ctx->nbrkbest * sizeof(int));
+        memcpy(job->brk, ctx->brkbest, ctx->nbrkbest * sizeof(int));
+    }
+
+    para_free(ctx);
+    return NULL;
+}
+
+/* break every paragraph on nthreads threads, or one per processor if 0 */
+void para_layout(para_job_t *jobs, int njobs, int nthreads)
+{
+    para_pool_t pool;
+    pthread_t *tid;
+    int i;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > njobs)
+        nthreads = njobs;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    pool.jobs = jobs;
+    pool.njobs = njobs;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    tid = malloc(nthreads * sizeof(pthread_t));
+    for (i = 1; i < nthreads; i++)
+        pthread_create(&tid[i], NULL, para_worker, &pool);
+    para_worker(&pool);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    free(tid);
+}
+
+/* ----------------------------------------------------------------------- */
+
 char text[] =
 "In the population of Transylvania there are four "
 "distinct nationalities: Saxons in the South, "
@@ -363,19 +1168,347 @@ char text[] =
 "century they found the Huns settled in it."
 ;
 
+#ifdef BENCH
+
+/*
+ * cc -O2 -DBENCH -o para-bench para.c rune.c -lpthread
+ * para-bench [-n paragraphs] [-t threads] [-e edits] [-c words]
+ *
+ * Lay out a made-up book of paragraphs of 20 to 400 words taken from
+ * the sample text, with more and more threads. Then insert, replace
+ * and delete words in a long paragraph at several widths, breaking it
+ * again after each edit with para_edit and from scratch; the breaks
+ * and total demerits must come out the same. Last, break paragraphs of 100 words
+ * and more, doubling up to -c words, with each breaker, to show how
+ * its time and the lines it tries grow with the paragraph.
+ */
+
+#include <time.h>
+
+#define nelem(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char **bench_book(int npara, long *nwords)
+{
+    char **paras, *words[1000], *buf, *p;
+    int nw, i, k, n;
+    unsigned seed = 1;
+
+    buf = strdup(text);
+    nw = 0;
+    for (p = strtok(buf, " "); p && nw < 1000; p = strtok(NULL, " "))
+        words[nw++] = p;
+
+    *nwords = 0;
+    paras = malloc(npara * sizeof(char *));
+    for (i = 0; i < npara; i++) {
+        seed = seed * 1103515245 + 12345;
+        n = 20 + (seed >> 8) % 381;
+        paras[i] = p = malloc(n * 16 + 1);
+        for (k = 0; k < n; k++) {
+            seed = seed * 1103515245 + 12345;
+            p += sprintf(p, "%s ", words[(seed >> 8) % nw]);
+        }
+        *nwords += n;
+    }
+
+    free(buf);
+    return paras;
+}
+
+static void bench_edits(char **paras, int npara, int nedits)
+{
+    static float widths[] = { 30, 40, 50, 60, 75 };
+    para_ctx *inc, *full;
+    char *words[] = { "a", "the", "Transylvania", "nationalities", "of", "conquered" };
+    double tinc, tfull, t;
+    int i, k, w, at, ndel, bad;
+    unsigned seed = 7;
+
+    for (w = 0; w < nelem(widths); w++) {
+        inc = para_new();
+        full = para_new();
+        para_set_width(inc, widths[w]);
+        para_set_width(full, widths[w]);
+        para_add_root(inc);
+        para_add_root(full);
+        for (i = 0; i < npara && i < 10; i++) {
+            para_words(inc, paras[i]);
+            para_words(full, paras[i]);
+        }
+        inc->nitems--;
+        full->nitems--;
+        para_add_sentinel(inc);
+        para_add_sentinel(full);
+        para_format3(inc);
+
+        /* insert, replace or delete words, keeping the last one */
+        tinc = tfull = 0;
+        bad = 0;
+        for (i = 0; i < nedits; i++) {
+            seed = seed * 1103515245 + 12345;
+            ndel = 2 * ((seed >> 8) % 3);
+            if (inc->nitems < 8)
+                ndel = 0;
+            seed = seed * 1103515245 + 12345;
+            at = 1 + 2 * ((seed >> 8) % ((inc->nitems - 1 - ndel) / 2));
+            seed = seed * 1103515245 + 12345;
+            k = (seed >> 8) % nelem(words);
+
+            t = now();
+            para_edit(inc, at, ndel, words[k]);
+            tinc += now() - t;
+
+            full->fitted = 0;
+            t = now();
+            para_edit(full, at, ndel, words[k]);
+            tfull += now() - t;
+
+            if (inc->nbrkbest != full->nbrkbest ||
+                memcmp(inc->brkbest, full->brkbest, inc->nbrkbest * sizeof(int)) ||
+                inc->item[inc->nitems].demerits != full->item[full->nitems].demerits)
+                bad++;
+        }
+
+        printf("%d edits at width %g in %d words: %.1f us each, %.1f us from scratch\n",
+               nedits, widths[w], inc->nitems / 2, tinc * 1e6 / nedits, tfull * 1e6 / nedits);
+        if (bad)
+            printf("%d edits broke differently\n", bad);
+
+        para_free(inc);
+        para_free(full);
+    }
+}
+
+static struct {
+    char *name;
+    void (*format)(para_ctx *ctx);
+} breakers[] = {
+    { "format2", para_format2 },
+    { "format3", para_format3 },
+    { "sq", para_format_sq },
+};
+
+static void bench_curve(char **paras, int npara, int maxwords)
+{
+    para_ctx *ctx;
+    double t;
+    int i, n, b, runs;
+
+    printf("%7s %-8s %9s %12s\n", "words", "breaker", "ns/item", "tried/item");
+    for (n = 100; n <= maxwords; n *= 2) {
+        ctx = para_new();
+        para_add_root(ctx);
+        for (i = 0; i < npara && ctx->nitems <= 2 * n; i++)
+            para_words(ctx, paras[i]);
+        if (ctx->nitems <= 2 * n) {
+            para_free(ctx);
+            break;
+        }
+        ctx->nitems = 2 * n;
+        para_add_sentinel(ctx);
+
+        for (b = 0; b < nelem(breakers); b++) {
+            runs = 0;
+            t = now();
+            do {
+                breakers[b].format(ctx);
+                runs++;
+            } while (now() - t < 0.1);
+            t = now() - t;
+            printf("%7d %-8s %9.1f %12.1f\n", n, breakers[b].name,
+                   t * 1e9 / runs / ctx->nitems,
+                   (double)ctx->examined / ctx->nitems);
+        }
+        para_free(ctx);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    para_add_root();
-    parse(text);
-    para_add_sentinel();
+    int npara = 5000, nedits = 1000, maxwords = 25600, maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    para_job_t *jobs, *ref;
+    char **paras;
+    long nwords;
+    double t, t1 = 0;
+    int c, i, n, bad;
+
+    while ((c = getopt(argc, argv, "n:t:e:c:")) != -1) {
+        switch (c) {
+        case 'n': npara = atoi(optarg); break;
+        case 't': maxthreads = atoi(optarg); break;
+        case 'e': nedits = atoi(optarg); break;
+        case 'c': maxwords = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: para-bench [-n paragraphs] [-t threads] [-e edits] [-c words]\n");
+            return 1;
+        }
+    }
+    if (maxthreads < 1)
+        maxthreads = 1;
 
-    print();
+    paras = bench_book(npara, &nwords);
+    printf("%d paragraphs, %ld words\n", npara, nwords);
+    printf("%7s %9s %11s %8s\n", "threads", "seconds", "words/s", "speedup");
 
-    bestcost = 1<<30;
-    //para_format(0,0,0);
-    //pretty();
+    ref = NULL;
+    for (n = 1; n <= maxthreads; n = n < maxthreads && n * 2 > maxthreads ? maxthreads : n * 2) {
+        jobs = calloc(npara, sizeof(para_job_t));
+        for (i = 0; i < npara; i++)
+            jobs[i].text = paras[i];
 
-    bestcost = 1<<30;
-    para_format2();
-    pretty();
+        t = now();
+        para_layout(jobs, npara, n);
+        t = now() - t;
+        if (n == 1)
+            t1 = t;
+        printf("%7d %9.3f %11.0f %7.2fx\n", n, t, nwords / t, t1 / t);
+
+        if (!ref) {
+            ref = jobs;
+            continue;
+        }
+        bad = 0;
+        for (i = 0; i < npara; i++)
+            if (jobs[i].nbrk != ref[i].nbrk ||
+                memcmp(jobs[i].brk, ref[i].brk, jobs[i].nbrk * sizeof(int)))
+                bad++;
+        if (bad)
+            printf("%d paragraphs broke differently\n", bad);
+        for (i = 0; i < npara; i++)
+            free(jobs[i].brk);
+        free(jobs);
+    }
+
+    bench_edits(paras, npara, nedits);
+    bench_curve(paras, npara, maxwords);
+
+    for (i = 0; i < npara; i++) {
+        free(ref[i].brk);
+        free(paras[i]);
+    }
+    free(ref);
+    free(paras);
+    return 0;
+}
+
+#else
+
+/*
+ * cc -o para para.c rune.c -lpthread
+ * para [-2|-q] [-w] [-h patterns]
+ *
+ * -w sets the sample text in Times-Roman, where an n is 1 wide. With
+ * -DHYPH and hyph.c, -h hyphenates it with TeX patterns or a compiled
+ * image.
+ */
+
+static short timesroman[95] = {
+    250, 333, 408, 500, 500, 833, 778, 333, 333, 333, 500, 564, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 278, 278, 564, 564, 564, 444,
+    921, 722, 667, 667, 722, 611, 556, 722, 722, 333, 389, 722, 611, 889, 722, 722,
+    556, 722, 667, 556, 611, 722, 722, 944, 722, 722, 611, 333, 278, 333, 469, 500,
+    333, 444, 500, 444, 500, 444, 333, 500, 500, 278, 278, 500, 278, 778, 500, 500,
+    500, 500, 333, 389, 278, 500, 500, 722, 500, 500, 444, 480, 200, 480, 541,
+};
+
+static float measure_times(void *arg, int left, int code)
+{
+    if (code < 32 || code > 126)
+        return 1;
+    return timesroman[code - 32] / 500.0;
+}
+
+#ifdef HYPH
+
+#include "hyph.h"
+
+static int hyphenate(void *arg, Rune *word, int len, int *breaks, int maxbreaks)
+{
+    return hyph_runes(arg, word, len, breaks, maxbreaks);
 }
+
+static HyphTrie *loadpatterns(char *filename)
+{
+    HyphTrie *ht;
+    TrieNode *trie;
+
+    ht = hyph_loadtrie(filename);
+    if (ht)
+        return ht;
+    trie = hyph_readpatterns(filename);
+    if (!trie)
+        return NULL;
+    ht = hyph_compiletrie(trie);
+    hyph_freetrie(trie);
+    return ht;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+    para_ctx *ctx = para_new();
+    int i, breaker = '3';
+#ifdef HYPH
+    HyphTrie *ht = NULL;
+#endif
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-2"))
+            breaker = '2';
+        else if (!strcmp(argv[i], "-q"))
+            breaker = 'q';
+        else if (!strcmp(argv[i], "-w"))
+            para_set_measure(ctx, measure_times, NULL);
+#ifdef HYPH
+        else if (!strcmp(argv[i], "-h") && i + 1 < argc) {
+            ht = loadpatterns(argv[++i]);
+            if (!ht) {
+                fprintf(stderr, "cannot load patterns: %s\n", argv[i]);
+                return 1;
+            }
+            para_set_hyphenate(ctx, hyphenate, ht);
+        }
+#endif
+        else {
+            fprintf(stderr, "usage: para [-2|-q] [-w] [-h patterns]\n");
+            return 1;
+        }
+    }
+
+    para_add_root(ctx);
+    parse(ctx, text);
+    para_add_sentinel(ctx);
+
+    print(ctx);
+
+    ctx->bestcost = 1<<30;
+    //para_work(ctx);
+    //para_format(ctx, 0,0,0);
+    //pretty(ctx);
+
+    ctx->bestcost = 1<<30;
+    if (breaker == '2')
+        para_format2(ctx);
+    else if (breaker == 'q')
+        para_format_sq(ctx);
+    else
+        para_format3(ctx);
+    pretty(ctx);
+
+    para_free(ctx);
+#ifdef HYPH
+    if (ht)
+        hyph_freecompiled(ht);
+#endif
+    return 0;
+}
+
+#endif
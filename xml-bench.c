@@ -0,0 +1,298 @@
+/*
+ * Benchmark for the XML parser in xml.c.
+ *
+ * Parses a corpus of documents several times, in both whitespace modes,
+ * and reports parse throughput, allocations per MB of input, the peak
+ * resident memory parsing adds to the input, and the time taken by
+ * xml_free. The files named on the command line are used as the corpus;
+ * without any, four synthetic documents are generated: record-oriented,
+ * text-heavy, attribute-heavy and deeply nested.
+ *
+ * Each document and mode is read or generated and measured in a child
+ * process, so the peak RSS figures do not include memory left over from
+ * earlier runs, and the peak before parsing is taken off.
+ *
+ *	cc -O2 -o xml-bench xml-bench.c
+ *	./xml-bench [-n runs] [-s megabytes] [file ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* the generated documents are kept in an int, with room to double */
+#define MAXSIZE 1023
+
+static long nalloc;
+static long nalloc_bytes;
+
+static void *bench_malloc(size_t n)
+{
+	nalloc++;
+	nalloc_bytes += n;
+	return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t m)
+{
+	nalloc++;
+	nalloc_bytes += n * m;
+	return calloc(n, m);
+}
+
+static void *bench_realloc(void *p, size_t n)
+{
+	nalloc++;
+	nalloc_bytes += n;
+	return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(n, m) bench_calloc(n, m)
+#define realloc(p, n) bench_realloc(p, n)
+#include "xml.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+struct buffer {
+	char *s;
+	int len, cap;
+};
+
+static void bputs(struct buffer *b, const char *s)
+{
+	int n = strlen(s);
+	if (b->len + n + 1 > b->cap) {
+		while (b->len + n + 1 > b->cap)
+			b->cap = b->cap ? b->cap * 2 : 4096;
+		b->s = realloc(b->s, b->cap);
+	}
+	memcpy(b->s + b->len, s, n + 1);
+	b->len += n;
+}
+
+static const char *words[] = {
+	"the", "of", "and", "a", "to", "in", "is", "you", "that", "it",
+	"he", "was", "for", "on", "are", "as", "with", "his", "they", "I",
+	"at", "be", "this", "have", "from", "or", "one", "had", "by", "word",
+	"but", "not", "what", "all", "were", "we", "when", "your", "can", "said",
+	"Transylvania", "nationalities", "descendants", "conquered", "&amp;", "&lt;tag&gt;",
+};
+
+static const char *word(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return words[(*seed >> 16) % (sizeof words / sizeof *words)];
+}
+
+static void gen_records(struct buffer *b, int size)
+{
+	char tmp[256];
+	int i;
+	bputs(b, "<?xml version=\"1.0\"?>\n<records>\n");
+	for (i = 0; b->len < size; ++i) {
+		sprintf(tmp, "  <record id=\"%d\">\n    <name>Name %d</name>\n"
+			"    <email>user%d@example.com</email>\n"
+			"    <amount currency=\"EUR\">%d.%02d</amount>\n"
+			"    <active>%s</active>\n  </record>\n",
+			i, i, i, i * 37 % 10000, i % 100, i & 1 ? "true" : "false");
+		bputs(b, tmp);
+	}
+	bputs(b, "</records>\n");
+}
+
+static void gen_text(struct buffer *b, int size)
+{
+	unsigned seed = 1;
+	int i;
+	bputs(b, "<?xml version=\"1.0\"?>\n<book>\n");
+	while (b->len < size) {
+		bputs(b, "<chapter>\n<title>Chapter</title>\n");
+		for (i = 0; i < 20; ++i) {
+			int k, n = 40 + i * 7 % 120;
+			bputs(b, "<p>");
+			for (k = 0; k < n; ++k) {
+				bputs(b, word(&seed));
+				bputs(b, k % 23 == 22 ? "\n" : " ");
+			}
+			bputs(b, k % 5 == 0 ? "<em>emphasis</em>.</p>\n" : ".</p>\n");
+		}
+		bputs(b, "</chapter>\n");
+	}
+	bputs(b, "</book>\n");
+}
+
+static void gen_atts(struct buffer *b, int size)
+{
+	char tmp[512];
+	int i;
+	bputs(b, "<?xml version=\"1.0\"?>\n<glyphs>\n");
+	for (i = 0; b->len < size; ++i) {
+		sprintf(tmp, "<glyph id=\"g%d\" unicode=\"&#x%04x;\" name=\"uni%04X\" "
+			"advance=\"%d\" lsb=\"%d\" xmin=\"%d\" ymin=\"%d\" xmax=\"%d\" ymax=\"%d\" "
+			"class=\"base\" script=\"latn\"/>\n",
+			i, 0x20 + i % 0x5000, 0x20 + i % 0x5000,
+			500 + i % 300, i % 50, i % 40, -(i % 200), 400 + i % 300, 700 + i % 20);
+		bputs(b, tmp);
+	}
+	bputs(b, "</glyphs>\n");
+}
+
+static void gen_nested(struct buffer *b, int size)
+{
+	char tmp[64];
+	int i;
+	bputs(b, "<?xml version=\"1.0\"?>\n<tree>\n");
+	while (b->len < size) {
+		for (i = 0; i < 200; ++i) {
+			sprintf(tmp, "<node depth=\"%d\">", i);
+			bputs(b, tmp);
+			if (i % 10 == 0)
+				bputs(b, "<leaf>x</leaf>");
+		}
+		for (i = 0; i < 200; ++i)
+			bputs(b, "</node>\n");
+	}
+	bputs(b, "</tree>\n");
+}
+
+static char *read_file(const char *filename, int *lenp)
+{
+	FILE *f = fopen(filename, "rb");
+	char *s;
+	int n;
+	if (!f) {
+		fprintf(stderr, "cannot open '%s'\n", filename);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	s = malloc(n + 1);
+	n = fread(s, 1, n, f);
+	s[n] = 0;
+	fclose(f);
+	*lenp = n;
+	return s;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, char *s, int len, int preserve_white, int runs)
+{
+	double parse_time = 0, free_time = 0, t0, t1, mb;
+	long allocs = 0;
+	struct rusage base, ru;
+	xml_item *xml;
+	char *error;
+	int i;
+
+	getrusage(RUSAGE_SELF, &base);
+	for (i = 0; i < runs; ++i) {
+		nalloc = 0;
+		t0 = now();
+		xml = xml_parse(s, preserve_white, &error);
+		t1 = now();
+		if (!xml) {
+			printf("%-16s %5d  parse error: %s\n", name, preserve_white, error);
+			return;
+		}
+		parse_time += t1 - t0;
+		allocs += nalloc;
+		t0 = now();
+		xml_free(xml);
+		free_time += now() - t0;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	mb = len / (1024.0 * 1024.0);
+	printf("%-16s %5d %8.1f %8.2f %10.0f %9ld %8.2f\n",
+		name, preserve_white, mb,
+		mb * runs / parse_time,
+		allocs / (mb * runs),
+		(ru.ru_maxrss - base.ru_maxrss) / 1024,
+		free_time * 1000 / runs);
+	fflush(stdout);
+}
+
+/* read the named file, or generate size bytes with gen, and measure it */
+static void run_doc(const char *name, void (*gen)(struct buffer *b, int size), int size,
+	int preserve_white, int runs)
+{
+	struct buffer b = { NULL, 0, 0 };
+	if (gen)
+		gen(&b, size);
+	else
+		b.s = read_file(name, &b.len);
+	run(name, b.s, b.len, preserve_white, runs);
+	free(b.s);
+}
+
+static void run_child(const char *name, void (*gen)(struct buffer *b, int size), int size,
+	int preserve_white, int runs)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		run_doc(name, gen, size, preserve_white, runs);
+		exit(0);
+	}
+	if (pid < 0)
+		run_doc(name, gen, size, preserve_white, runs);
+	else
+		waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*gen)(struct buffer *b, int size);
+	} corpus[] = {
+		{ "records", gen_records },
+		{ "text", gen_text },
+		{ "attributes", gen_atts },
+		{ "nested", gen_nested },
+	};
+	int runs = 5, size = 16;
+	int c, i, w;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n': runs = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: xml-bench [-n runs] [-s megabytes] [file ...]\n");
+			return 1;
+		}
+	}
+	if (runs < 1 || size < 1 || size > MAXSIZE) {
+		fprintf(stderr, "xml-bench: runs must be at least 1, megabytes from 1 to %d\n", MAXSIZE);
+		return 1;
+	}
+
+	printf("%-16s %5s %8s %8s %10s %9s %8s\n",
+		"document", "white", "MB", "MB/s", "allocs/MB", "peak MB", "free ms");
+	fflush(stdout);
+
+	if (optind < argc) {
+		for (i = optind; i < argc; ++i)
+			for (w = 0; w < 2; ++w)
+				run_child(argv[i], NULL, 0, w, runs);
+	} else {
+		for (i = 0; i < (int)(sizeof corpus / sizeof *corpus); ++i)
+			for (w = 0; w < 2; ++w)
+				run_child(corpus[i].name, corpus[i].gen, (size_t)size << 20, w, runs);
+	}
+
+	return 0;
+}
@@ -1,5 +1,12 @@
-#include <stdlib.h> /* malloc, free, strtol */
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* malloc, free */
 #include <string.h> /* memmove, strcmp */
+#include <errno.h> /* EINTR */
+#include <unistd.h> /* write */
+#include <sys/uio.h> /* writev */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "xml.h"
 
@@ -16,7 +23,7 @@ static int runetochar(char *s, int c)
 	}
 	if (c > 0x10FFFF)
 		c = 0xFFFD;
-	if (c < 0x1000) {
+	if (c < 0x10000) {
 		s[0] = 0xE0 | (c >> 12);
 		s[1] = 0x80 | ((c >> 6) & 0x3F);
 		s[2] = 0x80 | (c & 0x3F);
@@ -29,10 +36,29 @@ static int runetochar(char *s, int c)
 	return 4;
 }
 
+struct entity {
+	const char *name, *value;
+	int nlen, vlen;
+	int next; /* next entity with the same first character, or -1 */
+};
+
+static struct entity xml_predefined[] = {
+	{ "lt", "<", 2, 1, -1 },
+	{ "gt", ">", 2, 1, -1 },
+	{ "amp", "&", 3, 1, -1 },
+	{ "apos", "'", 4, 1, -1 },
+	{ "quot", "\"", 4, 1, -1 },
+};
+
+enum { XML_MAXENTITY = 32 };
+
 struct {
 	xml_item *head;
 	int preserve_white;
 	int depth;
+	struct entity *ents;
+	int ent_head[128]; /* first entity for each leading character, or -1 */
+	int ent_grow; /* most bytes an entity adds to its replacement */
 } g;
 
 struct attribute {
@@ -48,33 +74,122 @@ struct xml_item {
 	xml_item *up, *down, *tail, *prev, *next;
 };
 
+/*
+ * Compact read-only trees.
+ *
+ * All nodes live in one flat array, linked by 32-bit indices, followed by
+ * an attribute array and a string pool with each tag name stored only once.
+ * A compact node starts with a byte that can never begin a parsed tag name,
+ * so the navigation functions below work on both kinds of tree.
+ */
+
+#define XML_COMPACT 0xFF
+
+struct xml_cnode {
+	unsigned char mark; /* XML_COMPACT */
+	unsigned char pad[3];
+	int natts;
+	int self; /* index of this node, to find the document */
+	int up, down, next; /* -1 if none */
+	int name; /* offset of interned name in string pool; 0 for text nodes */
+	int data; /* offset of text for text nodes, first attribute for tags */
+};
+
+struct xml_catt {
+	int name, value;
+};
+
+struct xml_doc {
+	int nnodes, natts;
+	struct xml_cnode nodes[1];
+	/* followed by struct xml_catt atts[natts] and the string pool */
+};
+
+static inline int xml_is_compact(xml_item *item)
+{
+	return *(unsigned char *)item == XML_COMPACT;
+}
+
+static inline struct xml_cnode *xml_cnode(xml_item *item)
+{
+	return (struct xml_cnode *)item;
+}
+
+static inline struct xml_doc *xml_cdoc(struct xml_cnode *node)
+{
+	node -= node->self;
+	return (struct xml_doc *)((char *)node - offsetof(struct xml_doc, nodes));
+}
+
+static inline struct xml_catt *xml_catts(struct xml_doc *doc)
+{
+	return (struct xml_catt *)(doc->nodes + doc->nnodes);
+}
+
+static inline char *xml_cchars(struct xml_doc *doc)
+{
+	return (char *)(xml_catts(doc) + doc->natts);
+}
+
+static inline xml_item *xml_clink(struct xml_cnode *node, int k)
+{
+	return k < 0 ? NULL : (xml_item *)(node - node->self + k);
+}
+
 xml_item *xml_prev(xml_item *item)
 {
-	return item ? item->prev : NULL;
+	struct xml_cnode *node, *base;
+	int k;
+	if (!item)
+		return NULL;
+	if (!xml_is_compact(item))
+		return item->prev;
+	node = xml_cnode(item);
+	base = node - node->self;
+	k = node->up < 0 ? 0 : base[node->up].down;
+	if (k == node->self)
+		return NULL;
+	while (base[k].next != node->self)
+		k = base[k].next;
+	return (xml_item *)(base + k);
 }
 
 xml_item *xml_next(xml_item *item)
 {
+	if (item && xml_is_compact(item))
+		return xml_clink(xml_cnode(item), xml_cnode(item)->next);
 	return item ? item->next : NULL;
 }
 
 xml_item *xml_up(xml_item *item)
 {
+	if (item && xml_is_compact(item))
+		return xml_clink(xml_cnode(item), xml_cnode(item)->up);
 	return item ? item->up : NULL;
 }
 
 xml_item *xml_down(xml_item *item)
 {
+	if (item && xml_is_compact(item))
+		return xml_clink(xml_cnode(item), xml_cnode(item)->down);
 	return item ? item->down : NULL;
 }
 
 char *xml_text(xml_item *item)
 {
+	if (item && xml_is_compact(item)) {
+		struct xml_cnode *node = xml_cnode(item);
+		return node->name ? NULL : xml_cchars(xml_cdoc(node)) + node->data;
+	}
 	return item ? item->text : NULL;
 }
 
 char *xml_tag(xml_item *item)
 {
+	if (item && xml_is_compact(item)) {
+		struct xml_cnode *node = xml_cnode(item);
+		return node->name ? xml_cchars(xml_cdoc(node)) + node->name : NULL;
+	}
 	return item && item->name[0] ? item->name : NULL;
 }
 
@@ -82,6 +197,10 @@ int xml_is_tag(xml_item *item, const char *name)
 {
 	if (!item)
 		return 0;
+	if (xml_is_compact(item)) {
+		struct xml_cnode *node = xml_cnode(item);
+		return !strcmp(xml_cchars(xml_cdoc(node)) + node->name, name);
+	}
 	return !strcmp(item->name, name);
 }
 
@@ -90,6 +209,17 @@ char *xml_att(xml_item *item, const char *name)
 	struct attribute *att;
 	if (!item)
 		return NULL;
+	if (xml_is_compact(item)) {
+		struct xml_cnode *node = xml_cnode(item);
+		struct xml_doc *doc = xml_cdoc(node);
+		struct xml_catt *catt = xml_catts(doc) + node->data;
+		char *chars = xml_cchars(doc);
+		int i;
+		for (i = 0; i < node->natts; ++i)
+			if (!strcmp(chars + catt[i].name, name))
+				return chars + catt[i].value;
+		return NULL;
+	}
 	for (att = item->atts; att; att = att->next)
 		if (!strcmp(att->name, name))
 			return att->value;
@@ -99,25 +229,21 @@ char *xml_att(xml_item *item, const char *name)
 xml_item *xml_find(xml_item *item, const char *tag)
 {
 	while (item) {
-		if (!strcmp(item->name, tag))
+		if (xml_is_tag(item, tag))
 			return item;
-		item = item->next;
+		item = xml_next(item);
 	}
 	return NULL;
 }
 
 xml_item *xml_find_next(xml_item *item, const char *tag)
 {
-	if (item)
-		item = item->next;
-	return xml_find(item, tag);
+	return xml_find(xml_next(item), tag);
 }
 
 xml_item *xml_find_down(xml_item *item, const char *tag)
 {
-	if (item)
-		item = item->down;
-	return xml_find(item, tag);
+	return xml_find(xml_down(item), tag);
 }
 
 static void xml_free_attribute(struct attribute *att)
@@ -133,6 +259,12 @@ static void xml_free_attribute(struct attribute *att)
 
 void xml_free(xml_item *item)
 {
+	if (item && xml_is_compact(item)) {
+		/* compact trees are freed in one piece from the first root */
+		if (xml_cnode(item)->self == 0)
+			free(xml_cdoc(xml_cnode(item)));
+		return;
+	}
 	while (item) {
 		xml_item *next = item->next;
 		if (item->text)
@@ -146,36 +278,211 @@ void xml_free(xml_item *item)
 	}
 }
 
-static int xml_parse_entity(int *c, char *a)
+struct xml_build {
+	struct xml_cnode *nodes;
+	struct xml_catt *atts;
+	char *chars;
+	int nnodes, natts, nchars;
+	int *names; /* hash table of interned name offsets, 0 if empty */
+	unsigned nmask;
+};
+
+static void xml_count(xml_item *item, struct xml_build *b)
+{
+	struct attribute *att;
+	for (; item; item = item->next) {
+		b->nnodes++;
+		b->nchars += strlen(item->name) + 1;
+		if (item->text)
+			b->nchars += strlen(item->text) + 1;
+		for (att = item->atts; att; att = att->next) {
+			b->natts++;
+			b->nchars += strlen(att->name) + 1;
+			b->nchars += (att->value ? strlen(att->value) : 0) + 1;
+		}
+		xml_count(item->down, b);
+	}
+}
+
+static int xml_add_string(struct xml_build *b, const char *s)
+{
+	int n = strlen(s) + 1;
+	int ofs = b->nchars;
+	memcpy(b->chars + ofs, s, n);
+	b->nchars += n;
+	return ofs;
+}
+
+static int xml_intern(struct xml_build *b, const char *s)
+{
+	unsigned h = 0;
+	const char *p;
+	if (!s[0])
+		return 0;
+	for (p = s; *p; ++p)
+		h = *(unsigned char *)p + (h << 6) + (h << 16) - h;
+	for (h &= b->nmask; b->names[h]; h = (h + 1) & b->nmask)
+		if (!strcmp(b->chars + b->names[h], s))
+			return b->names[h];
+	return b->names[h] = xml_add_string(b, s);
+}
+
+static int xml_compact_list(xml_item *item, int up, struct xml_build *b)
 {
-	char *b;
-	if (a[1] == '#') {
-		if (a[2] == 'x')
-			*c = strtol(a + 3, &b, 16);
+	struct xml_cnode *node;
+	struct attribute *att;
+	int first = -1, prev = -1;
+	int k, n;
+
+	for (; item; item = item->next) {
+		k = b->nnodes++;
+		node = b->nodes + k;
+		node->mark = XML_COMPACT;
+		node->pad[0] = node->pad[1] = node->pad[2] = 0;
+		node->self = k;
+		node->up = up;
+		node->next = -1;
+		node->name = xml_intern(b, item->name);
+		node->natts = 0;
+		if (item->text) {
+			node->data = xml_add_string(b, item->text);
+		} else {
+			/* the parser keeps attributes in reverse order */
+			for (att = item->atts; att; att = att->next)
+				node->natts++;
+			node->data = b->natts;
+			b->natts += node->natts;
+			n = b->natts;
+			for (att = item->atts; att; att = att->next) {
+				--n;
+				b->atts[n].name = xml_intern(b, att->name);
+				b->atts[n].value = xml_add_string(b, att->value ? att->value : "");
+			}
+		}
+		if (prev < 0)
+			first = k;
 		else
-			*c = strtol(a + 2, &b, 10);
-		if (*b == ';')
-			return b - a + 1;
-	} else if (a[1] == 'l' && a[2] == 't' && a[3] == ';') {
-		*c = '<';
-		return 4;
-	} else if (a[1] == 'g' && a[2] == 't' && a[3] == ';') {
-		*c = '>';
-		return 4;
-	} else if (a[1] == 'a' && a[2] == 'm' && a[3] == 'p' && a[4] == ';') {
-		*c = '&';
-		return 5;
-	} else if (a[1] == 'a' && a[2] == 'p' && a[3] == 'o' && a[4] == 's' && a[5] == ';') {
-		*c = '\'';
-		return 6;
-	} else if (a[1] == 'q' && a[2] == 'u' && a[3] == 'o' && a[4] == 't' && a[5] == ';') {
-		*c = '"';
-		return 6;
-	}
-	*c = *a;
+			b->nodes[prev].next = k;
+		prev = k;
+		node->down = xml_compact_list(item->down, k, b);
+	}
+	return first;
+}
+
+xml_item *xml_compact(xml_item *item)
+{
+	struct xml_build b;
+	struct xml_doc *doc;
+	size_t head;
+
+	if (!item || xml_is_compact(item))
+		return item;
+
+	memset(&b, 0, sizeof b);
+	xml_count(item, &b);
+
+	head = offsetof(struct xml_doc, nodes) + b.nnodes * sizeof(struct xml_cnode);
+	doc = malloc(head + b.natts * sizeof(struct xml_catt) + b.nchars + 1);
+	doc->nnodes = b.nnodes;
+	doc->natts = b.natts;
+
+	for (b.nmask = 64; b.nmask < (unsigned)(b.nnodes + b.natts) * 2; b.nmask <<= 1)
+		;
+	b.names = calloc(b.nmask, sizeof *b.names);
+	b.nmask--;
+
+	b.nodes = doc->nodes;
+	b.atts = xml_catts(doc);
+	b.chars = xml_cchars(doc);
+	b.nnodes = b.natts = 0;
+	b.chars[0] = 0;
+	b.nchars = 1;
+
+	xml_compact_list(item, -1, &b);
+	free(b.names);
+
+	/* give back the space saved by interning the names */
+	doc = realloc(doc, head + b.natts * sizeof(struct xml_catt) + b.nchars);
+	return (xml_item *)doc->nodes;
+}
+
+static const signed char xml_digit[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* Decode the entity at a (which is '&') into *sp. Return the number of bytes used. */
+static int xml_decode_entity(char **sp, char *a, char *b)
+{
+	struct entity *ent;
+	char *p = a + 1;
+	int n, k;
+
+	if (p < b && *p == '#') {
+		int base = 10, c = 0, d;
+		if (++p < b && (*p == 'x' || *p == 'X')) {
+			base = 16;
+			++p;
+		}
+		for (n = 0; p < b && (d = xml_digit[(unsigned char)*p] - 1) >= 0 && d < base; ++p, ++n)
+			if (c <= 0x10FFFF)
+				c = c * base + d;
+		if (n > 0 && p < b && *p == ';') {
+			if (c == 0 || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+				c = 0xFFFD;
+			*sp += runetochar(*sp, c);
+			return p + 1 - a;
+		}
+	} else if (p < b && (unsigned char)*p < 128) {
+		for (n = 1; n <= XML_MAXENTITY && p + n < b; ++n) {
+			if (p[n] == ';') {
+				for (k = g.ent_head[(unsigned char)*p]; k >= 0; k = ent->next) {
+					ent = &g.ents[k];
+					if (ent->nlen == n && !memcmp(ent->name, p, n)) {
+						memcpy(*sp, ent->value, ent->vlen);
+						*sp += ent->vlen;
+						return n + 2;
+					}
+				}
+				break;
+			}
+		}
+	}
+
+	/* not an entity, keep the '&' as is */
+	*(*sp)++ = '&';
 	return 1;
 }
 
+/* Copy text from a to b into a new string, expanding entities. */
+static char *xml_decode(char *a, char *b)
+{
+	char *p, *s, *out;
+	int n = b - a;
+
+	if (g.ent_grow > 0)
+		for (p = a; (p = memchr(p, '&', b - p)) != NULL; ++p)
+			n += g.ent_grow;
+
+	/* predefined and numeric entities are all longer than their replacement */
+	s = out = malloc(n + 1);
+	while (a < b) {
+		p = memchr(a, '&', b - a);
+		if (!p) {
+			memcpy(s, a, b - a);
+			s += b - a;
+			break;
+		}
+		memcpy(s, a, p - a);
+		s += p - a;
+		a = p + xml_decode_entity(&s, p, b);
+	}
+	*s = 0;
+	return out;
+}
+
 static inline int isname(int c)
 {
 	return c == '.' || c == '-' || c == '_' || c == ':' ||
@@ -243,22 +550,7 @@ static void xml_emit_att_name(char *a, char *b)
 
 static void xml_emit_att_value(char *a, char *b)
 {
-	xml_item *head = g.head;
-	struct attribute *att = head->atts;
-	char *s;
-	int c;
-
-	/* entities are all longer than UTFmax so runetochar is safe */
-	s = att->value = malloc(b - a + 1);
-	while (a < b) {
-		if (*a == '&') {
-			a += xml_parse_entity(&c, a);
-			s += runetochar(s, c);
-		} else {
-			*s++ = *a++;
-		}
-	}
-	*s = 0;
+	g.head->atts->value = xml_decode(a, b);
 }
 
 static void xml_emit_close_tag(void)
@@ -271,9 +563,7 @@ static void xml_emit_close_tag(void)
 static void xml_emit_text(char *a, char *b)
 {
 	static char *empty = "";
-	xml_item *head;
 	char *s;
-	int c;
 
 	/* Skip text outside the root tag */
 	if (g.depth == 0)
@@ -289,20 +579,7 @@ static void xml_emit_text(char *a, char *b)
 	}
 
 	xml_emit_open_tag(empty, empty);
-	head = g.head;
-
-	/* entities are all longer than UTFmax so runetochar is safe */
-	s = head->text = malloc(b - a + 1);
-	while (a < b) {
-		if (*a == '&') {
-			a += xml_parse_entity(&c, a);
-			s += runetochar(s, c);
-		} else {
-			*s++ = *a++;
-		}
-	}
-	*s = 0;
-
+	g.head->text = xml_decode(a, b);
 	xml_emit_close_tag();
 }
 
@@ -446,8 +723,55 @@ parse_attribute_value:
 	return "end of data in attribute value";
 }
 
+static void xml_init_entities(const char **map)
+{
+	struct entity *ent;
+	int npre = sizeof xml_predefined / sizeof *xml_predefined;
+	int i, n, c;
+
+	n = 0;
+	if (map)
+		while (map[n * 2])
+			++n;
+
+	if (n > 0) {
+		g.ents = malloc((npre + n) * sizeof *g.ents);
+		memcpy(g.ents, xml_predefined, sizeof xml_predefined);
+		for (i = 0; i < n; ++i) {
+			ent = &g.ents[npre + i];
+			ent->name = map[i * 2];
+			ent->value = map[i * 2 + 1];
+			ent->nlen = strlen(ent->name);
+			ent->vlen = strlen(ent->value);
+		}
+	} else {
+		g.ents = xml_predefined;
+	}
+
+	/* chain entities by first character; earlier definitions take precedence */
+	for (c = 0; c < 128; ++c)
+		g.ent_head[c] = -1;
+	g.ent_grow = 0;
+	for (i = npre + n - 1; i >= 0; --i) {
+		ent = &g.ents[i];
+		c = (unsigned char)ent->name[0];
+		if (c >= 128 || ent->nlen == 0 || ent->nlen > XML_MAXENTITY)
+			continue;
+		ent->next = g.ent_head[c];
+		g.ent_head[c] = i;
+		if (g.ent_grow < ent->vlen - ent->nlen - 2)
+			g.ent_grow = ent->vlen - ent->nlen - 2;
+	}
+}
+
 xml_item *
 xml_parse(char *s, int preserve_white, char **errorp)
+{
+	return xml_parse_with_entities(s, preserve_white, NULL, errorp);
+}
+
+xml_item *
+xml_parse_with_entities(char *s, int preserve_white, const char **map, char **errorp)
 {
 	xml_item root, *node;
 	char *error;
@@ -456,8 +780,11 @@ xml_parse(char *s, int preserve_white, char **errorp)
 	g.head = &root;
 	g.preserve_white = preserve_white;
 	g.depth = 0;
+	xml_init_entities(map);
 
 	error = xml_parse_imp(s);
+	if (g.ents != xml_predefined)
+		free(g.ents);
 	if (error) {
 		if (errorp)
 			*errorp = error;
@@ -473,33 +800,350 @@ xml_parse(char *s, int preserve_white, char **errorp)
 	return root.down;
 }
 
-#ifdef TEST
-#include <stdio.h>
+/*
+ * Buffered writer.
+ *
+ * Output is collected in one large buffer. Runs of text that need no escaping
+ * are found 16 bytes at a time and copied whole; very long runs are handed to
+ * writev together with the pending buffer instead of being copied at all.
+ */
+
+enum { XML_WRITE_BUF = 64 << 10 };
+
+struct xml_writer {
+	int fd;
+	int error;
+	int open; /* start tag still waiting for its '>' */
+	char *buf;
+	int len, cap;
+	char *tags; /* names of open elements, NUL terminated */
+	int tlen, tcap;
+};
+
+/* Characters that must be escaped: bit 1 in text, bit 2 in attribute values. */
+static const unsigned char xml_escape_class[256] = {
+	['&'] = 3, ['<'] = 3, ['>'] = 3,
+	['"'] = 2, ['\t'] = 2, ['\n'] = 2, ['\r'] = 2,
+};
+
+xml_writer *xml_new_writer(int fd)
+{
+	xml_writer *w = malloc(sizeof *w);
+	w->fd = fd;
+	w->error = 0;
+	w->open = 0;
+	w->cap = XML_WRITE_BUF;
+	w->buf = malloc(w->cap);
+	w->len = 0;
+	w->tcap = 256;
+	w->tags = malloc(w->tcap);
+	w->tlen = 0;
+	return w;
+}
+
+static void xml_writev(xml_writer *w, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t k = writev(w->fd, iov, n);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			w->error = 1;
+			return;
+		}
+		while (n > 0 && (size_t)k >= iov->iov_len) {
+			k -= iov->iov_len;
+			++iov;
+			--n;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + k;
+			iov->iov_len -= k;
+		}
+	}
+}
+
+int xml_flush(xml_writer *w)
+{
+	if (w->fd >= 0 && w->len > 0) {
+		struct iovec iov;
+		iov.iov_base = w->buf;
+		iov.iov_len = w->len;
+		xml_writev(w, &iov, 1);
+		w->len = 0;
+	}
+	return w->error ? -1 : 0;
+}
+
+int xml_close_writer(xml_writer *w)
+{
+	int code = xml_flush(w);
+	free(w->buf);
+	free(w->tags);
+	free(w);
+	return code;
+}
+
+static void xml_reserve(xml_writer *w, int n)
+{
+	if (w->len + n <= w->cap)
+		return;
+	if (w->fd >= 0) {
+		xml_flush(w);
+		if (n <= w->cap)
+			return;
+	}
+	while (w->cap < w->len + n)
+		w->cap *= 2;
+	w->buf = realloc(w->buf, w->cap);
+}
+
+char *xml_writer_data(xml_writer *w, int *lenp)
+{
+	xml_reserve(w, 1);
+	w->buf[w->len] = 0;
+	if (lenp)
+		*lenp = w->len;
+	return w->buf;
+}
 
-static void dump(xml_item *item)
+static void xml_put(xml_writer *w, const char *s, int n)
+{
+	if (w->fd >= 0 && n >= w->cap / 2) {
+		struct iovec iov[2];
+		iov[0].iov_base = w->buf;
+		iov[0].iov_len = w->len;
+		iov[1].iov_base = (char *)s;
+		iov[1].iov_len = n;
+		xml_writev(w, iov, 2);
+		w->len = 0;
+		return;
+	}
+	xml_reserve(w, n);
+	memcpy(w->buf + w->len, s, n);
+	w->len += n;
+}
+
+static void xml_putc(xml_writer *w, int c)
+{
+	xml_reserve(w, 1);
+	w->buf[w->len++] = c;
+}
+
+static void xml_puts(xml_writer *w, const char *s)
+{
+	xml_put(w, s, strlen(s));
+}
+
+/* Return the end of the run of characters that need no escaping. */
+static const char *xml_skip_plain(const char *s, const char *e, int mask)
+{
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	while (e - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+		int bits;
+		if (mask & 2) {
+			m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+				_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+				_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)))));
+		}
+		bits = _mm_movemask_epi8(m);
+		if (bits)
+			return s + __builtin_ctz(bits);
+		s += 16;
+	}
+#endif
+	while (s < e && !(xml_escape_class[(unsigned char)*s] & mask))
+		++s;
+	return s;
+}
+
+static void xml_put_escaped(xml_writer *w, const char *s, const char *e, int mask)
+{
+	while (s < e) {
+		const char *p = xml_skip_plain(s, e, mask);
+		if (p > s)
+			xml_put(w, s, p - s);
+		if (p == e)
+			break;
+		switch (*p) {
+		case '&': xml_puts(w, "&amp;"); break;
+		case '<': xml_puts(w, "&lt;"); break;
+		case '>': xml_puts(w, "&gt;"); break;
+		case '"': xml_puts(w, "&quot;"); break;
+		case '\t': xml_puts(w, "&#9;"); break;
+		case '\n': xml_puts(w, "&#10;"); break;
+		case '\r': xml_puts(w, "&#13;"); break;
+		}
+		s = p + 1;
+	}
+}
+
+static void xml_close_start_tag(xml_writer *w)
+{
+	if (w->open) {
+		xml_putc(w, '>');
+		w->open = 0;
+	}
+}
+
+void xml_start_element(xml_writer *w, const char *tag)
+{
+	int n = strlen(tag) + 1;
+
+	xml_close_start_tag(w);
+	xml_putc(w, '<');
+	xml_put(w, tag, n - 1);
+	w->open = 1;
+
+	if (w->tlen + n > w->tcap) {
+		while (w->tlen + n > w->tcap)
+			w->tcap *= 2;
+		w->tags = realloc(w->tags, w->tcap);
+	}
+	memcpy(w->tags + w->tlen, tag, n);
+	w->tlen += n;
+}
+
+void xml_write_att(xml_writer *w, const char *name, const char *value)
+{
+	/* attributes are only allowed directly after a start tag */
+	if (!w->open)
+		return;
+	xml_putc(w, ' ');
+	xml_puts(w, name);
+	xml_put(w, "=\"", 2);
+	xml_put_escaped(w, value, value + strlen(value), 2);
+	xml_putc(w, '"');
+}
+
+void xml_end_element(xml_writer *w)
+{
+	char *tag;
+
+	if (w->tlen == 0)
+		return;
+	tag = w->tags + w->tlen - 1;
+	while (tag > w->tags && tag[-1])
+		--tag;
+	w->tlen = tag - w->tags;
+
+	if (w->open) {
+		xml_put(w, "/>", 2);
+		w->open = 0;
+	} else {
+		xml_put(w, "</", 2);
+		xml_puts(w, tag);
+		xml_putc(w, '>');
+	}
+}
+
+void xml_write_text(xml_writer *w, const char *text, int len)
+{
+	if (len < 0)
+		len = strlen(text);
+	xml_close_start_tag(w);
+	xml_put_escaped(w, text, text + len, 1);
+}
+
+void xml_write_cdata(xml_writer *w, const char *text, int len)
+{
+	const char *s, *e, *p;
+
+	if (len < 0)
+		len = strlen(text);
+	s = p = text;
+	e = text + len;
+
+	xml_close_start_tag(w);
+	xml_put(w, "<![CDATA[", 9);
+
+	/* split the section around any "]]>" in the text */
+	while ((p = memchr(p, ']', e - p)) != NULL) {
+		if (e - p >= 3 && p[1] == ']' && p[2] == '>') {
+			xml_put(w, s, p + 2 - s);
+			xml_put(w, "]]><![CDATA[", 12);
+			s = p + 2;
+		}
+		++p;
+	}
+	xml_put(w, s, e - s);
+	xml_put(w, "]]>", 3);
+}
+
+static void xml_write_att_list(xml_writer *w, struct attribute *att)
+{
+	/* the parser keeps attributes in reverse order */
+	if (att) {
+		xml_write_att_list(w, att->next);
+		xml_write_att(w, att->name, att->value ? att->value : "");
+	}
+}
+
+static void xml_write_atts(xml_writer *w, xml_item *item)
+{
+	if (xml_is_compact(item)) {
+		struct xml_cnode *node = xml_cnode(item);
+		struct xml_doc *doc = xml_cdoc(node);
+		struct xml_catt *catt = xml_catts(doc) + node->data;
+		char *chars = xml_cchars(doc);
+		int i;
+		for (i = 0; i < node->natts; ++i)
+			xml_write_att(w, chars + catt[i].name, chars + catt[i].value);
+	} else {
+		xml_write_att_list(w, item->atts);
+	}
+}
+
+void xml_write_item(xml_writer *w, xml_item *item)
 {
 	while (item) {
 		char *tag = xml_tag(item);
 		if (tag) {
-			printf("<%s>\n", tag);
-			dump(xml_down(item));
-			printf("</%s>\n", tag);
+			xml_start_element(w, tag);
+			xml_write_atts(w, item);
+			xml_write_item(w, xml_down(item));
+			xml_end_element(w);
 		} else {
-			printf("%s\n", xml_text(item));
+			xml_write_text(w, xml_text(item), -1);
 		}
 		item = xml_next(item);
 	}
 }
 
+char *xml_serialize(xml_item *item, int *lenp)
+{
+	xml_writer *w = xml_new_writer(-1);
+	char *s;
+	xml_write_item(w, item);
+	s = xml_writer_data(w, lenp);
+	free(w->tags);
+	free(w);
+	return s;
+}
+
+#ifdef TEST
+#include <stdio.h>
+
 int main(int argc, char **argv)
 {
+	xml_writer *w;
 	xml_item *xml;
 	char *error, *s;
 	FILE *f;
 	int n;
 
 	if (argc < 2) {
-		fprintf(stderr, "usage: xml filename");
+		fprintf(stderr, "usage: xml filename [-c]");
 		return 1;
 	}
 	f = fopen(argv[1], "rb");
@@ -520,7 +1164,15 @@ int main(int argc, char **argv)
 		fprintf(stderr, "xml parse error: %s\n", error);
 		return 1;
 	}
-	dump(xml);
+	if (argc > 2 && !strcmp(argv[2], "-c")) {
+		xml_item *c = xml_compact(xml);
+		xml_free(xml);
+		xml = c;
+	}
+	w = xml_new_writer(1);
+	xml_write_item(w, xml);
+	xml_putc(w, '\n');
+	xml_close_writer(w);
 	xml_free(xml);
 
 	return 0;
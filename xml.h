@@ -6,9 +6,17 @@ typedef struct xml_item xml_item;
 /* UTF-8 string and return xml tree as nodes. NULL if there is a parse error. */
 xml_item *xml_parse(char *buf, int preserve_white, char **error);
 
+/* Like xml_parse, but also expand the entities in map: a NULL terminated list of name and replacement pairs. */
+xml_item *xml_parse_with_entities(char *buf, int preserve_white, const char **map, char **error);
+
 /* Free the XML node and all its children and siblings. */
 void xml_free(xml_item *item);
 
+/* xml_compact: Return a read-only copy of the tree packed into one block, using
+ * about half the memory. The original tree is left alone. Free the copy with
+ * xml_free on the returned root. */
+xml_item *xml_compact(xml_item *item);
+
 /* Navigate the XML tree */
 xml_item *xml_prev(xml_item *item);
 xml_item *xml_next(xml_item *item);
@@ -31,4 +39,31 @@ xml_item *xml_find(xml_item *item, const char *tag);
 xml_item *xml_find_next(xml_item *item, const char *tag);
 xml_item *xml_find_down(xml_item *item, const char *tag);
 
+/* Buffered XML writer. Output goes to the file descriptor fd, or is kept in memory if fd is -1. */
+typedef struct xml_writer xml_writer;
+
+xml_writer *xml_new_writer(int fd);
+
+/* xml_close_writer: Flush and free the writer. Return -1 if any write failed. */
+int xml_close_writer(xml_writer *w);
+
+/* xml_flush: Write buffered output to the file descriptor. Return -1 if any write failed. */
+int xml_flush(xml_writer *w);
+
+/* xml_writer_data: Return the NUL terminated output of a memory writer. */
+char *xml_writer_data(xml_writer *w, int *lenp);
+
+/* Streaming output. Text and attribute values are escaped; len < 0 means strlen. */
+void xml_start_element(xml_writer *w, const char *tag);
+void xml_write_att(xml_writer *w, const char *name, const char *value);
+void xml_write_text(xml_writer *w, const char *text, int len);
+void xml_write_cdata(xml_writer *w, const char *text, int len);
+void xml_end_element(xml_writer *w);
+
+/* xml_write_item: Write the XML node and all its children and siblings. */
+void xml_write_item(xml_writer *w, xml_item *item);
+
+/* xml_serialize: Return the XML node and its siblings as a malloc'd string. */
+char *xml_serialize(xml_item *item, int *lenp);
+
 #endif